@@ -0,0 +1,23 @@
+#pragma once
+
+// configuration for the jd_bench host executable (see main.c)
+
+#include <stdio.h>
+
+// no bus; frames only go through the send queue and loopback, drained by the benchmark
+#define JD_PHYSICAL 0
+#define JD_CLIENT 1
+#define JD_DEVICESCRIPT 0
+#define JD_LSTORE 0
+// room for a full JD_OPIPE_MAX_WINDOW of frames in flight
+#define JD_SEND_FRAME_SIZE 2048
+#define JD_RX_QUEUE_SIZE 2048
+#define JD_CONFIG_STATUS 0
+#define JD_CONFIG_CONTROL_FLOOD 0
+#define JD_SIMPLE_ALLOC 0
+#define JD_SEND_FRAME 1
+#define JD_VERBOSE_ASSERT 1
+#define JD_MS_TIMER 1
+#define JD_LOG(...) ((void)0)
+#define DMESG(fmt, ...) printf(fmt "\n", ##__VA_ARGS__)
+#define JD_FLASH_PAGE_SIZE 4096
@@ -0,0 +1,97 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Host driver for the frame pipeline benchmark (source/jd_bench.c), timed with the wall clock.
+//
+// build: cmake -S . -B build -DJACDAC_BENCH=ON && cmake --build build --target jd_bench
+// usage: build/jd_bench
+
+#include "jd_protocol.h"
+#include <stdlib.h>
+#include <time.h>
+
+void jd_bench_init(void);
+void jd_bench_run(void);
+
+uint32_t now;
+const char app_dev_class_name[] = "jd_bench";
+const char app_fw_version[] = "v0.0.0";
+uint8_t jd_connected_blink;
+
+void app_init_services(void) {
+    jd_bench_init();
+}
+
+uint32_t app_get_device_class(void) {
+    return 0x3ffffff2;
+}
+
+uint64_t hw_device_id(void) {
+    return 0x5100c0ffee000001ULL;
+}
+
+void hw_panic(void) {
+    DMESG("PANIC");
+    abort();
+}
+
+void target_reset(void) {
+    exit(1);
+}
+
+void *(jd_alloc)(uint32_t size) {
+    void *r = calloc(1, size);
+    if (!r)
+        hw_panic();
+    return r;
+}
+
+void (jd_free)(void *ptr) {
+    free(ptr);
+}
+
+void jd_alloc_init(void) {}
+void jd_alloc_stack_check(void) {}
+
+uint64_t tim_get_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void tim_init(void) {}
+
+// single-threaded, there is nothing to mask
+void target_disable_irq(void) {}
+void target_enable_irq(void) {}
+int target_in_irq(void) {
+    return 0;
+}
+
+void target_wait_us(uint32_t n) {
+    uint64_t end = tim_get_micros() + n;
+    while (tim_get_micros() < end)
+        ;
+}
+
+// the benchmark drains the send queue itself
+void jd_packet_ready(void) {}
+
+// no status LED or power control
+void jd_blink(uint8_t encoded) {}
+void jd_glow(uint32_t glow) {}
+void power_pin_enable(int en) {}
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // there is no jd_init() without JD_PHYSICAL
+    jd_alloc_init();
+    jd_tx_init();
+    jd_rx_init();
+    jd_services_init();
+    jd_refresh_now();
+
+    jd_bench_run();
+    return 0;
+}
@@ -9,13 +9,15 @@ static void TODO(void) {
     JD_PANIC();
 }
 
+#define QUERY_PENDING 1
+
 typedef struct reg_query {
     struct reg_query *next;
     jd_thread_t asker;
     void *dst;
     uint16_t code;
     uint8_t dst_size;
-    uint8_t ok;
+    int8_t status; // QUERY_PENDING or JDC_STATUS_*
 } reg_query_t;
 
 struct jdc_client {
@@ -25,12 +27,20 @@ struct jdc_client {
     jd_device_service_t *service;
     void *userdata;
     reg_query_t *queries;
+    // threads in jdc_get_register() that still hold a pointer to the client
+    unsigned num_readers;
+    jd_thread_t destroyer;
     jdc_event_cb_t event_cb;
     unsigned write_timeout;
     unsigned read_timeout;
     uint8_t read_flags;
     uint8_t write_flags;
     uint8_t streaming_counter;
+    // events waiting for the callback thread
+    uint8_t ev_head;
+    uint8_t ev_count;
+    uint16_t ev_dropped;
+    jdc_event_t events[JDC_EVENT_QUEUE_SIZE];
 };
 
 static jdc_t client_list;
@@ -38,10 +48,55 @@ static jd_mutex_t client_mut;
 
 static jd_thread_t callback_thread;
 
+// ev_mut is never held while taking other locks
+static jd_mutex_t ev_mut;
+static bool events_pending;
+static bool has_events_waiter, has_bound_waiter;
+static jd_thread_t events_waiter, bound_waiter;
+
 static void jdc_event_handler(void *_state, int event_id, void *arg0, void *arg1);
 
+// returns 0 when resumed (possibly spuriously), -1 when deadline passed
+static int suspend_until(uint64_t deadline, unsigned timeout_ms) {
+    if (timeout_ms == JDC_TIMEOUT_FOREVER) {
+        jd_thr_suspend_self();
+        return 0;
+    }
+    uint64_t now = tim_get_micros();
+    if (now >= deadline)
+        return -1;
+    return jd_thr_suspend_self_timeout((unsigned)((deadline - now + 999) / 1000));
+}
+
+static uint64_t deadline_for(unsigned timeout_ms) {
+    return tim_get_micros() + (uint64_t)timeout_ms * 1000;
+}
+
+static bool all_bound(void) {
+    bool r = true;
+    jd_thr_lock(&client_mut);
+    for (jdc_t c = client_list; c; c = c->next)
+        if (!c->service)
+            r = false;
+    jd_thr_unlock(&client_mut);
+    return r;
+}
+
 void jdc_wait_roles_bound(unsigned timeout_ms) {
-    TODO();
+    uint64_t deadline = deadline_for(timeout_ms);
+    for (;;) {
+        // register before checking, so that a binding in between resumes us
+        jd_thr_lock(&ev_mut);
+        bound_waiter = jd_thr_self();
+        has_bound_waiter = true;
+        jd_thr_unlock(&ev_mut);
+
+        if (all_bound() || suspend_until(deadline, timeout_ms) != 0)
+            break;
+    }
+    jd_thr_lock(&ev_mut);
+    has_bound_waiter = false;
+    jd_thr_unlock(&ev_mut);
 }
 
 static void callback_worker(void *userdata) {
@@ -50,11 +105,13 @@ static void callback_worker(void *userdata) {
         cb();
     else
         jdc_wait_roles_bound(1000);
-    // event queue
+    for (;;)
+        jdc_process_events(JDC_TIMEOUT_FOREVER);
 }
 
 void jdc_start_threads(void (*init_cb)(void)) {
     jd_thr_init_mutex(&client_mut);
+    jd_thr_init_mutex(&ev_mut);
     jd_client_subscribe(jdc_event_handler, NULL);
     jd_thr_start_process_worker();
     callback_thread = jd_thr_start_thread(callback_worker, init_cb);
@@ -66,18 +123,55 @@ jdc_t jdc_create(uint32_t service_class, const char *name, jdc_event_cb_t event_
     jd_thr_init_mutex(&r->mutex);
     r->read_timeout = JDC_TIMEOUT_DEFAULT;
     r->write_timeout = JDC_TIMEOUT_DEFAULT;
+    r->event_cb = event_cb;
 
+    jd_thr_lock_main();
     jd_thr_lock(&client_mut);
     r->role = jd_role_alloc(name, service_class);
     r->next = client_list;
     client_list = r;
     jd_thr_unlock(&client_mut);
+    jd_thr_unlock_main();
 
     return r;
 }
 
+static void complete_queries(jdc_t c, uint16_t code, int status, jd_packet_t *pkt);
+
 void jdc_destroy(jdc_t c) {
-    TODO();
+    jd_thr_lock_main();
+    jd_thr_lock(&client_mut);
+    for (jdc_t *p = &client_list; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    jd_thr_unlock(&client_mut);
+    // no longer on the list, so the JD_CLIENT_EV_ROLE_CHANGED will not find it
+    jd_role_free(c->role);
+    jd_thr_unlock_main();
+
+    // fail any reads still in progress, and wait for their threads to let go of the client
+    jd_thr_lock(&c->mutex);
+    complete_queries(c, 0xffff, JDC_STATUS_UNBOUND, NULL);
+    while (c->num_readers) {
+        c->destroyer = jd_thr_self();
+        jd_thr_unlock(&c->mutex);
+        jd_thr_suspend_self();
+        jd_thr_lock(&c->mutex);
+    }
+    jd_thr_unlock(&c->mutex);
+
+    while (c->ev_count) {
+        jdc_event_t *ev = &c->events[c->ev_head];
+        if (ev->pkt)
+            jd_free(ev->pkt);
+        c->ev_head = (c->ev_head + 1) % JDC_EVENT_QUEUE_SIZE;
+        c->ev_count--;
+    }
+    jd_thr_destroy_mutex(&c->mutex);
+    jd_free(c);
 }
 
 jdc_t jdc_create_derived(jdc_t parent, jdc_event_cb_t event_cb) {
@@ -93,7 +187,7 @@ void jdc_configure_read(jdc_t c, unsigned flags, unsigned timeout_ms) {
 
 void jdc_configure_write(jdc_t c, unsigned flags, unsigned timeout_ms) {
     c->write_flags = flags;
-    c->read_timeout = timeout_ms;
+    c->write_timeout = timeout_ms;
 }
 
 void jdc_set_streaming(jdc_t c, bool enabled) {
@@ -158,14 +252,135 @@ static jdc_t find_and_lock(jd_role_t *role, jd_device_service_t *serv) {
 }
 
 jd_packet_t *jdc_dup_pkt(jd_packet_t *pkt) {
-    TODO();
-    return NULL;
+    unsigned sz = JD_SERIAL_FULL_HEADER_SIZE + pkt->service_size;
+    jd_packet_t *r = jd_alloc(sz);
+    memcpy(r, pkt, sz);
+    r->_size = (pkt->service_size + 4 + 3) & ~3;
+    return r;
 }
 
-static void jdc_emit_event(jdc_t c, uint16_t code, uint16_t subcode, void *arg) {
+static void wake_events_waiter(void) {
+    jd_thr_lock(&ev_mut);
+    events_pending = true;
+    bool wake = has_events_waiter;
+    has_events_waiter = false;
+    jd_thread_t t = events_waiter;
+    jd_thr_unlock(&ev_mut);
+    if (wake)
+        jd_thr_resume(t);
+}
+
+// called on the process thread, with c->mutex held
+static void jdc_emit_event(jdc_t c, uint16_t code, uint16_t subcode, jd_packet_t *pkt) {
     if (!c || !c->event_cb)
         return;
-    // add to queue
+
+    if (c->ev_count == JDC_EVENT_QUEUE_SIZE) {
+        // callbacks are lagging; the newest data is more useful than the oldest
+        jdc_event_t *old = &c->events[c->ev_head];
+        if (old->pkt)
+            jd_free(old->pkt);
+        c->ev_head = (c->ev_head + 1) % JDC_EVENT_QUEUE_SIZE;
+        c->ev_count--;
+        if (c->ev_dropped++ == 0)
+            DMESG("! hclient %s: event queue full", c->role->name);
+    }
+
+    jdc_event_t *ev = &c->events[(c->ev_head + c->ev_count) % JDC_EVENT_QUEUE_SIZE];
+    ev->code = code;
+    ev->subcode = subcode;
+    ev->pkt = pkt ? jdc_dup_pkt(pkt) : NULL;
+    c->ev_count++;
+
+    wake_events_waiter();
+}
+
+// the list is scanned from the start for each event, so callbacks can destroy clients
+static jdc_t pop_event(jdc_event_t *dst, jdc_event_cb_t *cb) {
+    jdc_t p;
+    jd_thr_lock(&client_mut);
+    for (p = client_list; p; p = p->next) {
+        jd_thr_lock(&p->mutex);
+        bool found = p->ev_count > 0;
+        if (found) {
+            *dst = p->events[p->ev_head];
+            *cb = p->event_cb;
+            p->ev_head = (p->ev_head + 1) % JDC_EVENT_QUEUE_SIZE;
+            p->ev_count--;
+        }
+        jd_thr_unlock(&p->mutex);
+        if (found)
+            break;
+    }
+    jd_thr_unlock(&client_mut);
+    return p;
+}
+
+static int run_pending_events(void) {
+    int num = 0;
+    jdc_event_t ev;
+    jdc_event_cb_t cb;
+    jdc_t c;
+    while ((c = pop_event(&ev, &cb)) != NULL) {
+        if (cb)
+            cb(c, &ev);
+        if (ev.pkt)
+            jd_free(ev.pkt);
+        num++;
+    }
+    return num;
+}
+
+int jdc_process_events(unsigned timeout_ms) {
+    uint64_t deadline = deadline_for(timeout_ms);
+    for (;;) {
+        jd_thr_lock(&ev_mut);
+        events_pending = false;
+        jd_thr_unlock(&ev_mut);
+
+        int num = run_pending_events();
+        if (num || timeout_ms == 0)
+            return num;
+
+        jd_thr_lock(&ev_mut);
+        bool pending = events_pending;
+        if (!pending) {
+            events_waiter = jd_thr_self();
+            has_events_waiter = true;
+        }
+        jd_thr_unlock(&ev_mut);
+
+        if (!pending && suspend_until(deadline, timeout_ms) != 0) {
+            jd_thr_lock(&ev_mut);
+            has_events_waiter = false;
+            jd_thr_unlock(&ev_mut);
+            return run_pending_events();
+        }
+    }
+}
+
+// called with c->mutex held
+static void complete_queries(jdc_t c, uint16_t code, int status, jd_packet_t *pkt) {
+    reg_query_t *rest = NULL, *next;
+    for (reg_query_t *r = c->queries; r; r = next) {
+        next = r->next;
+        if (code == 0xffff || r->code == code) {
+            if (status == JDC_STATUS_OK) {
+                unsigned sz = pkt->service_size;
+                if (sz > r->dst_size)
+                    sz = r->dst_size;
+                memcpy(r->dst, pkt->data, sz);
+                memset((uint8_t *)r->dst + sz, 0, r->dst_size - sz);
+            }
+            r->status = status;
+            // r lives on asker's stack; it's not to be touched after this
+            jd_thr_resume(r->asker);
+        } else {
+            r->next = rest;
+            rest = r;
+        }
+    }
+    c->queries = rest;
 }
 
 static void jdc_event_handler(void *_state, int event_id, void *arg0, void *arg1) {
@@ -182,7 +397,6 @@ static void jdc_event_handler(void *_state, int event_id, void *arg0, void *arg1
 
     switch (event_id) {
     case JD_CLIENT_EV_SERVICE_PACKET:
-    case JD_CLIENT_EV_SERVICE_REGISTER_CHANGED:
     case JD_CLIENT_EV_SERVICE_REGISTER_NOT_IMPLEMENTED:
         c = find_and_lock(NULL, serv);
         break;
@@ -202,6 +416,8 @@ static void jdc_event_handler(void *_state, int event_id, void *arg0, void *arg1
             jdc_emit_event(c, JDC_EV_SERVICE_EVENT, jd_event_code(pkt), pkt);
         } else if (jd_is_register_get(pkt)) {
             uint16_t code = JD_REG_CODE(pkt->service_command);
+            // every response completes the reads, not only the ones that changed the value
+            complete_queries(c, code, JDC_STATUS_OK, pkt);
             jdc_emit_event(c, JDC_EV_REG_VALUE, code, pkt);
             if (code == JD_REG_READING)
                 jdc_emit_event(c, JDC_EV_READING, code, pkt);
@@ -211,58 +427,111 @@ static void jdc_event_handler(void *_state, int event_id, void *arg0, void *arg1
         break;
 
     case JD_CLIENT_EV_ROLE_CHANGED:
+        if (c->service != serv)
+            complete_queries(c, 0xffff, JDC_STATUS_UNBOUND, NULL);
         c->service = serv;
-        if (serv)
+        if (serv) {
             jdc_emit_event(c, JDC_EV_BOUND, 0, NULL);
-        else
+            jd_thr_lock(&ev_mut);
+            bool wake = has_bound_waiter;
+            jd_thread_t t = bound_waiter;
+            jd_thr_unlock(&ev_mut);
+            if (wake)
+                jd_thr_resume(t);
+        } else {
             jdc_emit_event(c, JDC_EV_UNBOUND, 0, NULL);
+        }
         break;
 
-    case JD_CLIENT_EV_SERVICE_REGISTER_CHANGED:
-    case JD_CLIENT_EV_SERVICE_REGISTER_NOT_IMPLEMENTED: {
-        reg_query_t *rest = NULL, *next;
-        for (reg_query_t *r = c->queries; r; r = next) {
-            next = r->next;
-            if (r->code == reg->reg_code) {
-                if (event_id == JD_CLIENT_EV_SERVICE_REGISTER_NOT_IMPLEMENTED) {
-                    r->ok = 0;
-                } else {
-                    r->ok = 1;
-                    int sz = reg->resp_size;
-                    if (sz > r->dst_size)
-                        sz = r->dst_size;
-                    r->dst_size = sz;
-                    memcpy(r->dst, jd_register_data(reg), sz);
-                }
-                // the asker thread will jd_free() the data
-                jd_thr_resume(r->asker);
-            } else {
-                r->next = rest;
-                rest = r;
-            }
-        }
-        c->queries = rest;
-    } break;
+    case JD_CLIENT_EV_SERVICE_REGISTER_NOT_IMPLEMENTED:
+        complete_queries(c, reg->reg_code, JDC_STATUS_NOT_IMPL, NULL);
+        break;
     }
 
     jd_thr_unlock(&c->mutex);
 }
 
-int jdc_get_register(jdc_t c, uint16_t regcode, void *dst, unsigned size, unsigned refresh_ms) {
-    int r = 0;
+static void copy_value(const jd_register_query_t *q, void *dst, unsigned size) {
+    unsigned sz = q->resp_size;
+    if (sz > size)
+        sz = size;
+    memcpy(dst, jd_register_data(q), sz);
+    memset((uint8_t *)dst + sz, 0, size - sz);
+}
+
+int jdc_get_register(jdc_t c, uint16_t regcode, void *dst, unsigned size, unsigned cache_policy) {
+    int r = JDC_STATUS_OK;
+    unsigned timeout_ms = c->read_timeout;
+    reg_query_t rq;
+
+    if (size > 0xff)
+        return JDC_STATUS_OVERFLOW;
+
+    jd_thr_lock_main();
     jd_thr_lock(&c->mutex);
     if (!c->service) {
         r = JDC_STATUS_UNBOUND;
     } else {
-        const jd_register_query_t *q = jd_service_query(c->service, regcode, refresh_ms);
+        // we're called outside of the process thread
+        jd_refresh_now();
+        // only sends GET if it was never sent
+        const jd_register_query_t *q = jd_service_query(c->service, regcode, 0);
+        bool fresh = jd_register_has_value(q) &&
+                     (cache_policy == JDC_CACHE_FOREVER ||
+                      !in_past_ms(q->last_query_ms + cache_policy));
+        if (!fresh) {
+            // unless the first GET went out just now, and there's no response yet, send another
+            if (jd_register_has_value(q) || q->last_query_ms != now_ms)
+                q = jd_service_query(c->service, regcode, -1);
+            jd_client_flush_cmds();
+        }
+
         if (jd_register_not_implemented(q)) {
             r = JDC_STATUS_NOT_IMPL;
+        } else if (fresh ||
+                   (timeout_ms == JDC_TIMEOUT_IMMEDIATE_ONLY && jd_register_has_value(q))) {
+            copy_value(q, dst, size);
+        } else if (timeout_ms == JDC_TIMEOUT_IMMEDIATE_ONLY) {
+            r = JDC_STATUS_TIMEOUT;
         } else {
-            TODO();
+            rq.asker = jd_thr_self();
+            rq.dst = dst;
+            rq.code = regcode;
+            rq.dst_size = size;
+            rq.status = QUERY_PENDING;
+            rq.next = c->queries;
+            c->queries = &rq;
+            c->num_readers++;
+            r = QUERY_PENDING;
         }
     }
     jd_thr_unlock(&c->mutex);
-    return r;
+    jd_thr_unlock_main();
+
+    if (r != QUERY_PENDING)
+        return r;
+
+    uint64_t deadline = deadline_for(timeout_ms);
+    for (;;) {
+        int timed_out = suspend_until(deadline, timeout_ms);
+        jd_thr_lock(&c->mutex);
+        r = rq.status;
+        if (r == QUERY_PENDING && timed_out) {
+            for (reg_query_t **p = &c->queries; *p; p = &(*p)->next) {
+                if (*p == &rq) {
+                    *p = rq.next;
+                    break;
+                }
+            }
+            r = JDC_STATUS_TIMEOUT;
+        }
+        // c may be freed as soon as the mutex is released after this
+        if (r != QUERY_PENDING && --c->num_readers == 0 && c->destroyer)
+            jd_thr_resume(c->destroyer);
+        jd_thr_unlock(&c->mutex);
+        if (r != QUERY_PENDING)
+            return r;
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -13,8 +13,24 @@ static uint32_t next_gc;
 static uint8_t verbose_log = 0;
 
 #define EXPIRES_USEC (2000 * 1000)
+// devices are checked for expiry a slice every GC_PERIOD_USEC, with GC_SWEEP_USEC between sweeps
+#define GC_SWEEP_USEC (300 * 1000)
+#define GC_PERIOD_USEC (10 * 1000)
 jd_device_t *jd_devices;
 
+// jd_devices is kept sorted for iteration; lookups by device_identifier go through
+// an open-addressed (linear probing) hash table, which is kept at most half full
+static jd_device_t **dev_index;
+static uint16_t dev_index_size; // power of 2
+static uint16_t num_devices;
+// device_identifier of the next device to be checked by jd_device_gc(); 0 to start from first
+static uint64_t gc_cursor;
+static uint16_t gc_step;
+
+// commands to a single device are accumulated here, and sent when a command for another device
+// comes, the frame is full, or at the end of jd_client_process()
+static jd_frame_t cmd_frame;
+
 #if EVENT_CHECKING
 static uint8_t event_scope;
 #define EVENT_ENTER()                                                                              \
@@ -119,9 +135,69 @@ static bool fits_at(jd_device_t *existing, jd_device_t *fresh) {
                   sizeof(existing->device_identifier)) < 0);
 }
 
+// services[] is followed by service indices sorted by service class
+static uint8_t *jd_device_class_index(jd_device_t *d) {
+    return (uint8_t *)(d->services + d->num_services);
+}
+
+static uint32_t device_class_key(void *ctx, unsigned idx) {
+    return ((jd_device_t *)ctx)->services[idx].service_class;
+}
+
+static unsigned dev_hash(uint64_t device_identifier) {
+    uint32_t h = (uint32_t)device_identifier ^ (uint32_t)(device_identifier >> 32);
+    h *= 0x9e3779b1;
+    return h ^ (h >> 16);
+}
+
+static void dev_index_put(jd_device_t *d) {
+    unsigned mask = dev_index_size - 1;
+    unsigned i = dev_hash(d->device_identifier) & mask;
+    while (dev_index[i])
+        i = (i + 1) & mask;
+    dev_index[i] = d;
+}
+
+// called before `d` is linked into jd_devices
+static void dev_index_add(jd_device_t *d) {
+    num_devices++;
+    if (num_devices * 2 > dev_index_size) {
+        jd_free(dev_index);
+        dev_index_size = dev_index_size ? dev_index_size * 2 : 16;
+        dev_index = jd_alloc(dev_index_size * sizeof(jd_device_t *));
+        for (jd_device_t *p = jd_devices; p; p = p->next)
+            dev_index_put(p);
+    }
+    dev_index_put(d);
+}
+
+static void dev_index_remove(jd_device_t *d) {
+    unsigned mask = dev_index_size - 1;
+    unsigned i = dev_hash(d->device_identifier) & mask;
+    while (dev_index[i] != d) {
+        JD_ASSERT(dev_index[i] != NULL);
+        i = (i + 1) & mask;
+    }
+    // backward shift deletion - move up entries that would no longer be reachable
+    unsigned j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!dev_index[j])
+            break;
+        unsigned k = dev_hash(dev_index[j]->device_identifier) & mask;
+        // can dev_index[j] move to i? (is its home slot k cyclically outside of (i, j]?)
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            dev_index[i] = dev_index[j];
+            i = j;
+        }
+    }
+    dev_index[i] = NULL;
+    num_devices--;
+}
+
 static jd_device_t *jd_device_alloc(jd_packet_t *announce) {
     int num_services = announce->service_size >> 2;
-    int sz = sizeof(jd_device_t) + (num_services * sizeof(jd_device_service_t));
+    int sz = sizeof(jd_device_t) + (num_services * sizeof(jd_device_service_t)) + num_services;
     jd_device_t *d = jd_alloc(sz);
     d->num_services = num_services;
     d->device_identifier = announce->device_identifier;
@@ -135,7 +211,9 @@ static jd_device_t *jd_device_alloc(jd_packet_t *announce) {
         d->services[i].service_class = i == 0 ? 0 : services[i];
         d->services[i].service_index = i;
     }
+    jd_index_sort(jd_device_class_index(d), num_services, device_class_key, d);
 
+    dev_index_add(d);
     if (fits_at(jd_devices, d)) {
         d->next = jd_devices;
         jd_devices = d;
@@ -153,24 +231,52 @@ static jd_device_t *jd_device_alloc(jd_packet_t *announce) {
     return d;
 }
 
-void jd_device_clear_queries(jd_device_t *d, uint8_t service_idx) {
-    jd_register_query_t *tmp, *q = d->_queries, *prev = NULL;
-    while (q) {
-        if (service_idx == 0xff || q->service_index == service_idx) {
-            if (q == d->_queries)
-                d->_queries = q->next;
-            else
-                prev->next = q->next;
-            tmp = q;
-            q = q->next;
-            if (tmp->resp_size > JD_REGISTER_QUERY_MAX_INLINE)
-                jd_free(tmp->value.buffer);
-            jd_free(tmp);
-        } else {
-            prev = q;
-            q = q->next;
-        }
+// per-service register cache; queries live in chunks that never move, so pointers to them
+// stay valid until the queries are cleared; index[] is sorted by reg_code
+#define QUERY_CHUNK_SIZE 4
+typedef struct query_chunk {
+    struct query_chunk *next;
+    jd_register_query_t queries[QUERY_CHUNK_SIZE];
+} query_chunk_t;
+
+typedef struct jd_register_cache {
+    query_chunk_t *chunks; // last one first
+    uint16_t num_queries;
+    uint16_t capacity;
+    jd_register_query_t *index[0];
+} jd_register_cache_t;
+
+// register values longer than JD_REGISTER_QUERY_MAX_INLINE are kept in power-of-2 sized buffers,
+// so that changes in size mostly don't need re-allocation
+static unsigned value_capacity(unsigned size) {
+    if (size <= JD_REGISTER_QUERY_MAX_INLINE)
+        return 0;
+    unsigned cap = 8;
+    while (cap < size)
+        cap <<= 1;
+    return cap;
+}
+
+static void jd_service_clear_queries(jd_device_service_t *serv) {
+    jd_register_cache_t *c = serv->_queries;
+    if (!c)
+        return;
+    for (unsigned i = 0; i < c->num_queries; ++i)
+        if (c->index[i]->resp_size > JD_REGISTER_QUERY_MAX_INLINE)
+            jd_free(c->index[i]->value.buffer);
+    while (c->chunks) {
+        query_chunk_t *next = c->chunks->next;
+        jd_free(c->chunks);
+        c->chunks = next;
     }
+    jd_free(c);
+    serv->_queries = NULL;
+}
+
+void jd_device_clear_queries(jd_device_t *d, uint8_t service_idx) {
+    for (unsigned i = 0; i < d->num_services; ++i)
+        if (service_idx == 0xff || i == service_idx)
+            jd_service_clear_queries(&d->services[i]);
 }
 
 static void jd_device_free(jd_device_t *d) {
@@ -184,6 +290,7 @@ static void jd_device_free(jd_device_t *d) {
 }
 
 static void jd_device_unlink(jd_device_t *d) {
+    dev_index_remove(d);
     if (d == jd_devices) {
         jd_devices = d->next;
     } else {
@@ -196,89 +303,206 @@ static void jd_device_unlink(jd_device_t *d) {
     }
 }
 
+jd_device_t *jd_device_lookup(uint64_t device_identifier) {
+    if (!dev_index)
+        return NULL;
+    unsigned mask = dev_index_size - 1;
+    for (unsigned i = dev_hash(device_identifier) & mask; dev_index[i]; i = (i + 1) & mask)
+        if (dev_index[i]->device_identifier == device_identifier)
+            return dev_index[i];
+    return NULL;
+}
+
+// checks a slice of devices, resuming where the previous call stopped
 static void jd_device_gc(void) {
-    jd_device_t *p, *q;
-    while (jd_devices && in_past(jd_devices->_expires)) {
-        p = jd_devices;
-        jd_devices = p->next;
-        jd_device_free(p);
+    jd_device_t *d = gc_cursor ? jd_device_lookup(gc_cursor) : NULL;
+    if (!d) {
+        d = jd_devices;
+        // fixed for the whole sweep, as expired devices are removed while it's going
+        gc_step = num_devices / (GC_SWEEP_USEC / GC_PERIOD_USEC) + 1;
     }
-    for (p = jd_devices; p && p->next; p = p->next) {
-        if (in_past(p->next->_expires)) {
-            q = p->next;
-            p->next = q->next;
-            jd_device_free(q);
+    for (unsigned i = 0; d && i < gc_step; ++i) {
+        jd_device_t *next = d->next;
+        if (in_past(d->_expires)) {
+            jd_device_unlink(d);
+            jd_device_free(d);
         }
+        d = next;
     }
+    gc_cursor = d ? d->device_identifier : 0;
 }
 
-jd_device_t *jd_device_lookup(uint64_t device_identifier) {
-    jd_device_t *p = jd_devices;
-    while (p) {
-        if (p->device_identifier == device_identifier)
-            return p;
-        p = p->next;
+jd_device_service_t *jd_device_lookup_service(jd_device_t *dev, uint32_t service_class) {
+    uint8_t *index = jd_device_class_index(dev);
+    unsigned p =
+        jd_index_lower_bound(index, dev->num_services, service_class, device_class_key, dev);
+    if (p < dev->num_services) {
+        jd_device_service_t *serv = jd_device_get_service(dev, index[p]);
+        if (serv->service_class == service_class)
+            return serv;
     }
     return NULL;
 }
 
-jd_device_service_t *jd_device_lookup_service(jd_device_t *dev, uint32_t service_class) {
-    for (unsigned i = 0; i < dev->num_services; ++i)
-        if (jd_device_get_service(dev, i)->service_class == service_class)
-            return jd_device_get_service(dev, i);
-    return NULL;
+int jd_client_flush_cmds(void) {
+    if (cmd_frame.size == 0)
+        return 0;
+    cmd_frame.flags = JD_FRAME_FLAG_COMMAND;
+    jd_compute_crc(&cmd_frame);
+    // keep the commands for the next try when the send queue is full
+    if (!jd_tx_will_fit_frame(&cmd_frame))
+        return -1;
+    int r = jd_send_frame(&cmd_frame);
+    jd_reset_frame(&cmd_frame);
+    return r;
+}
+
+static bool cmd_frame_has_room(jd_device_t *dev, unsigned size) {
+    return cmd_frame.size && cmd_frame.device_identifier == dev->device_identifier &&
+           cmd_frame.size + 4 + size <= JD_SERIAL_PAYLOAD_SIZE;
+}
+
+static void *cmd_frame_push(jd_device_service_t *serv, uint16_t service_command,
+                            unsigned size) {
+    jd_device_t *dev = jd_service_parent(serv);
+    if (!cmd_frame_has_room(dev, size)) {
+        if (jd_client_flush_cmds() != 0)
+            return NULL;
+        cmd_frame.device_identifier = dev->device_identifier;
+        // the frame is sent at the end of main loop iteration; make sure there is one
+        JD_WAKE_MAIN();
+    }
+    return jd_push_in_frame(&cmd_frame, serv->service_index, service_command, size);
+}
+
+void *jd_service_cmd_reserve(jd_device_service_t *serv, uint16_t service_command,
+                             unsigned datasize) {
+    if (datasize + 4 > JD_SERIAL_PAYLOAD_SIZE)
+        return NULL;
+    return cmd_frame_push(serv, service_command, datasize);
 }
 
 int jd_service_send_cmd(jd_device_service_t *serv, uint16_t service_command, const void *data,
                         size_t datasize) {
-    jd_packet_t *pkt = jd_alloc(JD_SERIAL_FULL_HEADER_SIZE + datasize);
-    pkt->flags = JD_FRAME_FLAG_COMMAND;
-    pkt->device_identifier = jd_service_parent(serv)->device_identifier;
-    pkt->service_index = serv->service_index;
-    pkt->service_command = service_command;
-    pkt->service_size = datasize;
-    memcpy(pkt->data, data, datasize);
-    int r = jd_send_pkt(pkt);
-    jd_free(pkt);
-    return r;
+    void *trg = jd_service_cmd_reserve(serv, service_command, datasize);
+    if (!trg)
+        return -1;
+    if (datasize)
+        memcpy(trg, data, datasize);
+    return 0;
 }
 
-static jd_register_query_t *jd_service_query_lookup(jd_device_service_t *serv, int reg_code) {
-    jd_register_query_t *q = jd_service_parent(serv)->_queries;
-    int idx = serv->service_index;
-    while (q) {
-        if (q->reg_code == reg_code && (q->service_index & JD_SERVICE_INDEX_MASK) == idx)
-            return q;
-        q = q->next;
+// index of first query with reg_code not less than given one
+static unsigned query_lower_bound(jd_register_cache_t *c, int reg_code) {
+    unsigned l = 0, r = c->num_queries;
+    while (l < r) {
+        unsigned m = (l + r) >> 1;
+        if (c->index[m]->reg_code < reg_code)
+            l = m + 1;
+        else
+            r = m;
     }
+    return l;
+}
+
+static jd_register_query_t *jd_service_query_lookup(jd_device_service_t *serv, int reg_code) {
+    jd_register_cache_t *c = serv->_queries;
+    if (!c)
+        return NULL;
+    unsigned p = query_lower_bound(c, reg_code);
+    if (p < c->num_queries && c->index[p]->reg_code == reg_code)
+        return c->index[p];
     return NULL;
 }
 
+static jd_register_query_t *jd_service_query_add(jd_device_service_t *serv, int reg_code) {
+    jd_register_cache_t *c = serv->_queries;
+    if (!c || c->num_queries == c->capacity) {
+        unsigned cap = c ? c->capacity * 2 : QUERY_CHUNK_SIZE;
+        jd_register_cache_t *n = jd_alloc(sizeof(*n) + cap * sizeof(jd_register_query_t *));
+        n->capacity = cap;
+        if (c) {
+            n->chunks = c->chunks;
+            n->num_queries = c->num_queries;
+            memcpy(n->index, c->index, c->num_queries * sizeof(jd_register_query_t *));
+            jd_free(c);
+        }
+        serv->_queries = c = n;
+    }
+    unsigned slot = c->num_queries % QUERY_CHUNK_SIZE;
+    if (slot == 0) {
+        query_chunk_t *ch = jd_alloc(sizeof(query_chunk_t));
+        ch->next = c->chunks;
+        c->chunks = ch;
+    }
+    jd_register_query_t *q = &c->chunks->queries[slot]; // zeroed by jd_alloc()
+    unsigned p = query_lower_bound(c, reg_code);
+    memmove(c->index + p + 1, c->index + p, (c->num_queries - p) * sizeof(jd_register_query_t *));
+    c->index[p] = q;
+    c->num_queries++;
+    q->reg_code = reg_code;
+    q->service_index = serv->service_index;
+    return q;
+}
+
+static void jd_service_query_refresh(jd_device_service_t *serv, jd_register_query_t *q,
+                                     int refresh_ms) {
+    if (jd_register_not_implemented(q))
+        return;
+    bool due = !q->last_query_ms || refresh_ms < 0 ||
+               (refresh_ms && in_past_ms(q->last_query_ms + refresh_ms));
+    // if a frame to the device is going out anyway, refresh a bit early, so that
+    // queries on the device with similar refresh periods are sent together
+    if (!due && refresh_ms > 0 && cmd_frame_has_room(jd_service_parent(serv), 0) &&
+        in_past_ms(q->last_query_ms + refresh_ms / 2))
+        due = true;
+    if (due) {
+        if (cmd_frame_push(serv, JD_GET(q->reg_code), 0)) {
+            q->last_query_ms = now_ms;
+        } else {
+            // the send queue is full, the GET is re-tried on next call
+            jd_set_max_sleep(JD_MIN_MAX_SLEEP);
+            return;
+        }
+    }
+    // make sure the main loop wakes up in time for the next refresh
+    if (refresh_ms > 0) {
+        uint32_t deadline = q->last_query_ms + refresh_ms;
+        jd_set_max_sleep_ms(in_future_ms(deadline) ? deadline - now_ms : 0);
+    }
+}
+
 const jd_register_query_t *jd_service_query(jd_device_service_t *serv, int reg_code,
                                             int refresh_ms) {
     jd_register_query_t *q = jd_service_query_lookup(serv, reg_code);
-    if (!q) {
-        q = jd_alloc(sizeof(jd_register_query_t));
-        jd_device_t *dev = jd_service_parent(serv);
-        q->reg_code = reg_code;
-        q->service_index = serv->service_index;
-        q->next = dev->_queries;
-        dev->_queries = q;
-    }
-    if (!jd_register_not_implemented(q) &&
-        (!q->last_query_ms || (refresh_ms && in_past_ms(q->last_query_ms + refresh_ms)))) {
-        jd_service_send_cmd(serv, JD_GET(reg_code), NULL, 0);
-        q->last_query_ms = now_ms;
-    }
+    if (!q)
+        q = jd_service_query_add(serv, reg_code);
+    jd_service_query_refresh(serv, q, refresh_ms);
     return q;
 }
 
+void jd_service_query_many(jd_device_service_t *serv, const uint16_t *reg_codes,
+                           unsigned num_regs, int refresh_ms, const jd_register_query_t **dst) {
+    for (unsigned i = 0; i < num_regs; ++i) {
+        jd_register_query_t *q = jd_service_query_lookup(serv, reg_codes[i]);
+        if (!q)
+            q = jd_service_query_add(serv, reg_codes[i]);
+        jd_service_query_refresh(serv, q, refresh_ms);
+        if (dst)
+            dst[i] = q;
+    }
+}
+
 void jd_client_process(void) {
     EVENT_ENTER();
-    if (jd_should_sample(&next_gc, 300 * 1000)) {
+    if (in_past(next_gc)) {
         jd_device_gc();
+        // slices go every GC_PERIOD_USEC, then the main loop can sleep until the next sweep
+        next_gc = now + (gc_cursor ? GC_PERIOD_USEC : GC_SWEEP_USEC);
     }
+    jd_set_max_sleep(in_future(next_gc) ? next_gc - now : 0);
     jd_client_emit_event(JD_CLIENT_EV_PROCESS, NULL, NULL);
+    jd_client_flush_cmds();
     EVENT_LEAVE();
 }
 
@@ -296,18 +520,19 @@ static void handle_register(jd_device_service_t *serv, jd_packet_t *pkt) {
         jd_register_query_t *q = jd_service_query_lookup(serv, JD_REG_CODE(pkt->service_command));
         if (q) {
             int chg = 0;
-            if (q->resp_size != pkt->service_size ||
+            if (!jd_register_has_value(q) || q->resp_size != pkt->service_size ||
                 memcmp(pkt->data, jd_register_data(q), q->resp_size))
                 chg = 1;
 
-            if (pkt->service_size > JD_REGISTER_QUERY_MAX_INLINE) {
-                if (q->resp_size != pkt->service_size) {
-                    if (q->resp_size > JD_REGISTER_QUERY_MAX_INLINE)
-                        jd_free(q->value.buffer);
-                    q->value.buffer = jd_alloc(pkt->service_size);
-                }
+            unsigned cap = value_capacity(pkt->service_size);
+            if (cap != value_capacity(q->resp_size)) {
+                if (q->resp_size > JD_REGISTER_QUERY_MAX_INLINE)
+                    jd_free(q->value.buffer);
+                if (cap)
+                    q->value.buffer = jd_alloc(cap);
             }
             q->resp_size = pkt->service_size;
+            q->service_index |= 0x40;
             memcpy((void *)jd_register_data(q), pkt->data, q->resp_size);
             if (chg)
                 jd_client_emit_event(JD_CLIENT_EV_SERVICE_REGISTER_CHANGED, serv, q);
@@ -2,6 +2,9 @@
 
 #if JD_THR_PTHREAD
 
+#include <errno.h>
+#include <time.h>
+
 #define CHK JD_CHK
 
 #pragma region mutexes
@@ -27,94 +30,183 @@ void jd_thr_unlock(jd_mutex_t *mutex) {
 }
 #pragma endregion
 
-jd_thread_t jd_thr_self(void) {
-    return pthread_self();
+// all condition variables use CLOCK_MONOTONIC, so that wall-clock adjustments don't affect sleeps
+static pthread_condattr_t monotonic_attr;
+
+static void deadline_in(struct timespec *ts, uint64_t us) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
 }
 
 #pragma region suspend / resume thread
-typedef struct thread_cond {
-    struct thread_cond *next;
-    jd_thread_t thread;
+struct jd_thread {
+    pthread_t pthread;
     pthread_mutex_t lock;
     pthread_cond_t cond;
-    bool suspended;
-} thread_cond_t;
-static thread_cond_t *first_thread;
-static pthread_mutex_t thread_mux = PTHREAD_MUTEX_INITIALIZER;
-
-static thread_cond_t *lookup_thread_cond(jd_thread_t thr, bool create) {
-    thread_cond_t *p;
-    jd_thr_lock(&thread_mux);
-    for (p = first_thread; p; p = p->next) {
-        if (p->thread == thr)
-            break;
+    bool resumed;
+    // for jd_thr_start_thread()
+    void (*worker)(void *userdata);
+    void *userdata;
+    // in free_threads list
+    jd_thread_t next_free;
+};
+// holds jd_thread_t of the current thread; recycled when the thread exits
+static pthread_key_t thread_key;
+
+// records of exited threads are never freed, as other threads may still hold their handles;
+// they are re-used for new threads instead, so a stale jd_thr_resume() at worst causes
+// a spurious wake up, which callers of jd_thr_suspend_self*() have to handle anyway
+static pthread_mutex_t free_threads_mux = PTHREAD_MUTEX_INITIALIZER;
+static jd_thread_t free_threads;
+
+static jd_thread_t thread_alloc(void) {
+    CHK(pthread_mutex_lock(&free_threads_mux));
+    jd_thread_t t = free_threads;
+    if (t)
+        free_threads = t->next_free;
+    CHK(pthread_mutex_unlock(&free_threads_mux));
+
+    if (t) {
+        jd_thr_lock(&t->lock);
+        t->resumed = false;
+        t->worker = NULL;
+        t->userdata = NULL;
+        t->next_free = NULL;
+        jd_thr_unlock(&t->lock);
+        return t;
     }
-    if (p == NULL && create) {
-        p = jd_alloc(sizeof(*p));
-        jd_thr_init_mutex(&p->lock);
-        pthread_cond_init(&p->cond, NULL);
-        p->thread = thr;
-        p->next = first_thread;
-        first_thread = p;
+
+    t = jd_alloc(sizeof(*t));
+    jd_thr_init_mutex(&t->lock);
+    CHK(pthread_cond_init(&t->cond, &monotonic_attr));
+    return t;
+}
+
+static void thread_recycle(void *p) {
+    jd_thread_t t = p;
+    CHK(pthread_mutex_lock(&free_threads_mux));
+    t->next_free = free_threads;
+    free_threads = t;
+    CHK(pthread_mutex_unlock(&free_threads_mux));
+}
+
+jd_thread_t jd_thr_self(void) {
+    jd_thread_t t = pthread_getspecific(thread_key);
+    if (t == NULL) {
+        // a thread not started with jd_thr_start_thread(), eg. main()
+        t = thread_alloc();
+        t->pthread = pthread_self();
+        CHK(pthread_setspecific(thread_key, t));
     }
-    jd_thr_unlock(&thread_mux);
-    return p;
+    return t;
 }
 
 // note that these two are way simpler in an RTOS - it typically let's one just suspend/resume
 // threads
 void jd_thr_suspend_self(void) {
-    thread_cond_t *c = lookup_thread_cond(pthread_self(), true);
+    jd_thread_t c = jd_thr_self();
     jd_thr_lock(&c->lock);
-    JD_ASSERT(!c->suspended);
-    c->suspended = true;
-    do {
+    while (!c->resumed)
         CHK(pthread_cond_wait(&c->cond, &c->lock));
-    } while (c->suspended);
+    c->resumed = false;
     jd_thr_unlock(&c->lock);
 }
 
-void jd_thr_resume(jd_thread_t t) {
-    thread_cond_t *c = lookup_thread_cond(pthread_self(), false);
-    JD_ASSERT(c != NULL);
+int jd_thr_suspend_self_timeout(unsigned timeout_ms) {
+    struct timespec deadline;
+    deadline_in(&deadline, (uint64_t)timeout_ms * 1000);
+
+    jd_thread_t c = jd_thr_self();
+    int r = 0;
     jd_thr_lock(&c->lock);
-    JD_ASSERT(c->suspended);
-    c->suspended = false;
+    while (!c->resumed) {
+        if (pthread_cond_timedwait(&c->cond, &c->lock, &deadline) == ETIMEDOUT) {
+            r = -1;
+            break;
+        }
+    }
+    c->resumed = false;
+    jd_thr_unlock(&c->lock);
+    return r;
+}
+
+void jd_thr_resume(jd_thread_t c) {
+    jd_thr_lock(&c->lock);
+    c->resumed = true;
     CHK(pthread_cond_signal(&c->cond));
     jd_thr_unlock(&c->lock);
 }
 #pragma endregion
 
+static jd_thread_t process_thread;
+static pthread_mutex_t process_mux = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t process_cond;
+static bool process_pending;
+
+static pthread_mutex_t main_mux;
+
 void jd_thr_init(void) {
     JD_ASSERT(!thr_inited);
     thr_inited = true;
     CHK(pthread_mutexattr_init(&prio_inherit_attr));
     CHK(pthread_mutexattr_setprotocol(&prio_inherit_attr, PTHREAD_PRIO_INHERIT));
+
+    pthread_mutexattr_t attr;
+    CHK(pthread_mutexattr_init(&attr));
+    CHK(pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT));
+    CHK(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE));
+    CHK(pthread_mutex_init(&main_mux, &attr));
+    CHK(pthread_mutexattr_destroy(&attr));
+
+    CHK(pthread_condattr_init(&monotonic_attr));
+    CHK(pthread_condattr_setclock(&monotonic_attr, CLOCK_MONOTONIC));
+    CHK(pthread_cond_init(&process_cond, &monotonic_attr));
+    CHK(pthread_key_create(&thread_key, thread_recycle));
 }
 
-static jd_thread_t process_thread;
-static pthread_mutex_t process_mux = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t process_cond = PTHREAD_COND_INITIALIZER;
-static bool process_pending;
+void jd_thr_lock_main(void) {
+    CHK(pthread_mutex_lock(&main_mux));
+}
+
+void jd_thr_unlock_main(void) {
+    CHK(pthread_mutex_unlock(&main_mux));
+}
 
 void jd_thr_wake_main(void) {
+    if (!thr_inited)
+        return;
     jd_thr_lock(&process_mux);
     process_pending = true;
     pthread_cond_signal(&process_cond);
     jd_thr_unlock(&process_mux);
 }
 
+// jd_process_everything() leaves the time until the next timer of the stack (announce,
+// event re-transmission, pipe retries, sampling, ...) in jd_max_sleep;
+// we sleep until then, unless woken up earlier by jd_thr_wake_main() (eg. on frame reception)
 static void process_worker(void *userdata) {
+    struct timespec deadline;
     for (;;) {
+        jd_thr_lock_main();
+        jd_process_everything();
+        uint32_t sleep_us = jd_max_sleep;
+        jd_thr_unlock_main();
+
+        deadline_in(&deadline, sleep_us);
         jd_thr_lock(&process_mux);
-        if (!process_pending) {
-            struct timespec tenms = {.tv_sec = 0, .tv_nsec = 10 * 1000000};
-            pthread_cond_timedwait(&process_cond, &process_mux, &tenms);
+        while (!process_pending) {
+            int r = pthread_cond_timedwait(&process_cond, &process_mux, &deadline);
+            if (r == ETIMEDOUT)
+                break;
+            CHK(r);
         }
         process_pending = false;
         jd_thr_unlock(&process_mux);
-
-        jd_process_everything();
     }
 }
 
@@ -123,11 +215,21 @@ void jd_thr_start_process_worker(void) {
     process_thread = jd_thr_start_thread(process_worker, NULL);
 }
 
+static void *thread_main(void *arg) {
+    jd_thread_t t = arg;
+    CHK(pthread_setspecific(thread_key, t));
+    t->worker(t->userdata);
+    return NULL;
+}
+
+// the record is allocated here, so that the thread can be resumed before it gets to run
 jd_thread_t jd_thr_start_thread(void (*worker)(void *userdata), void *userdata) {
-    jd_thread_t t;
+    jd_thread_t t = thread_alloc();
+    t->worker = worker;
+    t->userdata = userdata;
 
-    CHK(pthread_create(&t, NULL, (void *(*)(void *))worker, userdata));
-    CHK(pthread_detach(t));
+    CHK(pthread_create(&t->pthread, NULL, thread_main, t));
+    CHK(pthread_detach(t->pthread));
 
     return t;
 }
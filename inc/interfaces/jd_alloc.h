@@ -42,4 +42,17 @@ void jd_free(void *ptr);
 void jd_alloc_stack_check(void);
 void *jd_alloc_emergency_area(uint32_t size);
 
+#if JD_ALLOC_STATS
+// Calls made through the macros below are counted (eg. by jd_bench.c).
+// Implementations have to be defined as `void *(jd_alloc)(uint32_t size)` and
+// `void (jd_free)(void *ptr)`, so that the macros don't apply to them.
+typedef struct {
+    uint32_t num_alloc;
+    uint32_t num_free;
+} jd_alloc_stats_t;
+extern jd_alloc_stats_t jd_alloc_stats;
+#define jd_alloc(size) (jd_alloc_stats.num_alloc++, (jd_alloc)(size))
+#define jd_free(ptr) (jd_alloc_stats.num_free++, (jd_free)(ptr))
+#endif
+
 #endif
\ No newline at end of file
@@ -47,6 +47,7 @@ void target_standby(uint32_t duration_ms);
 
 extern uint32_t jd_max_sleep;
 void jd_set_max_sleep(uint32_t us);
+void jd_set_max_sleep_ms(uint32_t ms);
 
 extern uint8_t cpu_mhz;
 void tim_init(void);
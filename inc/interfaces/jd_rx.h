@@ -11,11 +11,18 @@
 #include "jd_service_framework.h"
 
 void jd_rx_init(void);
+// called from the UART ISR; doesn't mask IRQs, so must not be called concurrently with itself
 int jd_rx_frame_received(jd_frame_t *frame);
 jd_frame_t *jd_rx_get_frame(void);
 void jd_rx_release_frame(jd_frame_t *frame);
 bool jd_rx_has_frame(void);
 
+#if JD_RX_ZERO_COPY
+// returns RX queue slot to receive the next frame into, or NULL when the queue is full;
+// the frame is queued if it's later passed to jd_rx_frame_received()
+jd_frame_t *jd_rx_reserve_frame(void);
+#endif
+
 #if JD_CLIENT || JD_BRIDGE
 // this will not forward the frame to the USB bridge
 int jd_rx_frame_received_loopback(jd_frame_t *frame);
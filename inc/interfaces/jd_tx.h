@@ -11,6 +11,8 @@
 
 void jd_tx_init(void);
 void jd_tx_flush(void);
+// called at the end of jd_services_tick(); flushes, unless held by JD_TX_COALESCE_US
+void jd_tx_process(void);
 int jd_tx_is_idle(void);
 jd_frame_t *jd_tx_get_frame(void);
 void jd_tx_frame_sent(jd_frame_t *frame);
@@ -37,6 +39,17 @@ static inline void jd_send_event(srv_t *srv, uint32_t eventid) {
 }
 void jd_process_event_queue(void);
 
+typedef struct {
+    uint8_t repeats;         // number of re-transmissions after the event is first sent
+    uint16_t first_delay_ms; // before first re-transmission
+    uint16_t delay_ms;       // between subsequent re-transmissions
+} jd_event_schedule_t;
+/**
+ * Set event re-transmission schedule for given service; NULL reverts to default.
+ * `sched` is not copied and has to stay valid.
+ */
+void jd_event_set_schedule(srv_t *srv, const jd_event_schedule_t *sched);
+
 // this is needed for pipes and clients, not regular servers
 // this will send the frame on the wire and on the USB bridge
 int jd_send_frame(jd_frame_t *f);
@@ -44,8 +57,32 @@ int jd_send_frame(jd_frame_t *f);
 int jd_send_frame_raw(jd_frame_t *f);
 
 bool jd_need_to_send(jd_frame_t *f);
+// whether jd_send_frame(f) would be queued now (checks the lane the frame would go into)
+bool jd_tx_will_fit_frame(jd_frame_t *f);
+// same for a frame of `size` bytes with regular register/report packets
 bool jd_tx_will_fit(unsigned size);
 
+#if JD_TX_PRIORITY_LANES
+#define JD_TX_LANE_CTRL 0   // control service and CRC ACKs
+#define JD_TX_LANE_EVENTS 1 // event reports
+#define JD_TX_LANE_REGS 2   // everything else
+#define JD_TX_LANE_BULK 3   // pipe data
+#define JD_TX_NUM_LANES 4
+
+typedef struct {
+    // written when frames are queued
+    uint32_t frames_queued;
+    uint32_t frames_dropped; // lane full
+    uint16_t max_occupancy;  // frames
+    // written when frames are sent
+    uint32_t frames_sent;
+} jd_tx_lane_stats_t;
+
+const jd_tx_lane_stats_t *jd_tx_lane_stats(unsigned lane);
+// number of frames currently waiting in lane
+unsigned jd_tx_lane_occupancy(unsigned lane);
+#endif
+
 // wrapper around jd_send_frame()
 int jd_send_pkt(jd_packet_t *pkt);
 
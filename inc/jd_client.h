@@ -37,7 +37,9 @@
 // Register was marked as not implemented (jd_device_service_t, jd_register_query_t)
 #define JD_CLIENT_EV_SERVICE_REGISTER_NOT_IMPLEMENTED 0x0021
 
-// Emitted on every jd_client_process() (roughly every 10ms), no arguments
+// Emitted on every jd_client_process(), no arguments; this is roughly every 10ms, unless
+// JD_IDLE_MAX_SLEEP is raised (the default with JD_THR_PTHREAD), in which case it only comes
+// when the stack wakes up (frame received, announce, register refresh due, ...)
 #define JD_CLIENT_EV_PROCESS 0x0030
 
 // A role assignment has changed (jd_device_service_t?, jd_role_t)
@@ -49,13 +51,13 @@ typedef struct jd_device_service {
     uint8_t flags;
     uint16_t userflags;
     void *userdata;
+    struct jd_register_cache *_queries;
 } jd_device_service_t;
 
 #define JD_DEVICE_SERVICE_FLAG_ROLE_ASSIGNED 0x01
 
 #define JD_REGISTER_QUERY_MAX_INLINE 4
 typedef struct jd_register_query {
-    struct jd_register_query *next;
     uint16_t reg_code;
     uint8_t service_index;
     uint8_t resp_size;
@@ -71,13 +73,17 @@ static inline bool jd_register_not_implemented(const jd_register_query_t *q) {
     return (q->service_index & 0x80) != 0;
 }
 
+// set once the first GET response has been received
+static inline bool jd_register_has_value(const jd_register_query_t *q) {
+    return (q->service_index & 0x40) != 0;
+}
+
 static inline const void *jd_register_data(const jd_register_query_t *q) {
     return q->resp_size > JD_REGISTER_QUERY_MAX_INLINE ? q->value.buffer : q->value.data;
 }
 
 typedef struct jd_device {
     struct jd_device *next;
-    jd_register_query_t *_queries;
     uint64_t device_identifier;
     uint8_t num_services;
     uint8_t _event_counter;
@@ -112,11 +118,33 @@ static inline jd_device_t *jd_service_parent(jd_device_service_t *serv) {
     return (jd_device_t *)((uint8_t *)(serv - serv->service_index) -
                            offsetof(jd_device_t, services));
 }
+// The jd_service_*() functions below have to be called from the main loop thread, or with
+// jd_thr_lock_main() held.
+// Commands (and GETs) are not sent right away; they are accumulated in a frame for the device,
+// which is sent when a command for another device comes, when it's full, or at the end of
+// the current main loop iteration (jd_client_process(), or after app_process()).
+// Returns 0 when the command was added to the frame, and -1 when it's too large, or when
+// the frame had to be sent but the send queue is full (the command is then dropped).
 int jd_service_send_cmd(jd_device_service_t *serv, uint16_t service_command, const void *data,
                         size_t datasize);
-// these are only valid until next event loop process
+// reserve space for command payload in the frame for the device; fill it before next
+// jd_service_*() call; returns NULL in the same cases jd_service_send_cmd() returns -1
+void *jd_service_cmd_reserve(jd_device_service_t *serv, uint16_t service_command,
+                             unsigned datasize);
+// the returned queries stay valid until the device goes away, or its queries are cleared
+// with jd_device_clear_queries()
+// GET is queued like a command (see above) when never sent before, or every refresh_ms
+// (if non-zero; negative - send now); if the send queue is full, it's re-tried on next call;
+// when called from the Jacdac thread, the main loop wakes up in time for the next refresh
 const jd_register_query_t *jd_service_query(jd_device_service_t *serv, int reg_code,
                                             int refresh_ms);
+// like jd_service_query() for several registers; GETs that are due go out in a single frame
+// at the end of main loop iteration; if `dst` is not NULL, it's filled with query for each register
+void jd_service_query_many(jd_device_service_t *serv, const uint16_t *reg_codes,
+                           unsigned num_regs, int refresh_ms, const jd_register_query_t **dst);
+// send commands accumulated for a device; this is done by jd_client_process() and after
+// app_process(); returns -1 when the send queue is full (the commands are kept for next try)
+int jd_client_flush_cmds(void);
 void jd_device_clear_queries(jd_device_t *d, uint8_t service_idx);
 
 #define JD_ROLE_HINT_NONE 0
@@ -78,6 +78,29 @@
 #define JD_EVENT_QUEUE_SIZE 128
 #endif
 
+// default event re-transmission schedule; can be overridden per service with
+// jd_event_set_schedule()
+#ifndef JD_EVENT_REPEATS
+#define JD_EVENT_REPEATS 2
+#endif
+#ifndef JD_EVENT_FIRST_DELAY_MS
+#define JD_EVENT_FIRST_DELAY_MS 20
+#endif
+#ifndef JD_EVENT_DELAY_MS
+#define JD_EVENT_DELAY_MS 50
+#endif
+#ifndef JD_EVENT_MAX_REPEATS
+#define JD_EVENT_MAX_REPEATS 8
+#endif
+
+// add or remove event re-transmissions depending on bus error rate (requires JD_PHYSICAL)
+#ifndef JD_EVENT_ADAPTIVE
+#define JD_EVENT_ADAPTIVE 0
+#endif
+#ifndef JD_EVENT_ADAPTIVE_PERIOD_MS
+#define JD_EVENT_ADAPTIVE_PERIOD_MS 2000
+#endif
+
 #ifndef JD_TIM_OVERHEAD
 #define JD_TIM_OVERHEAD 12
 #endif
@@ -92,6 +115,35 @@
 #define JD_PHYSICAL 1
 #endif
 
+// host-side simulated bus, see jd_sim.h
+#ifndef JD_SIM
+#define JD_SIM 0
+#endif
+
+// jd_crc16() implementation: 0 - bitwise, 4 or 8 - slice-by-4/8 (2k/4k of tables);
+// a single 256 entry table is not offered, as it measured no faster than bitwise
+// (826 vs 776 ns on a 236 byte frame), while slice-by-8 took 104 ns
+#ifndef JD_CRC16_SLICES
+#define JD_CRC16_SLICES (JD_64 ? 8 : 0)
+#endif
+
+// route jd_crc16() via jd_crc16_hw(), which can be provided by ports with CRC peripheral
+#ifndef JD_CRC16_HW
+#define JD_CRC16_HW 0
+#endif
+
+// bytes reserved at init for REG_DEFINITION() arrays flattened into sorted tables
+// (8 bytes per register), so that service_handle_register() doesn't walk the whole definition
+// on each packet; 0 to disable
+#ifndef JD_REG_DESC_CACHE
+#define JD_REG_DESC_CACHE (JD_64 ? 4096 : 0)
+#endif
+
+// compute CRC of incoming frames as data arrives; requires UART driver to call jd_rx_progress()
+#ifndef JD_RX_INCREMENTAL_CRC
+#define JD_RX_INCREMENTAL_CRC 0
+#endif
+
 #ifndef JD_CLIENT
 #define JD_CLIENT 0
 #endif
@@ -105,6 +157,18 @@
 #define JD_FREE_SUPPORTED JD_CLIENT
 #endif
 
+// input pipes with jd_ipipe_allow_reorder() keep up to that many packets that arrive ahead
+// of the next expected one; this is either 0, or JD_PIPE_MAX_IN_FLIGHT - 1 (as far ahead as
+// a sender can get); the 4kB for them is allocated on the first such packet
+#ifndef JD_IPIPE_REORDER
+#define JD_IPIPE_REORDER (JD_64 ? JD_PIPE_MAX_IN_FLIGHT - 1 : 0)
+#endif
+
+// input pipes are looked up by port in a hash table of that many buckets (power of 2)
+#ifndef JD_IPIPE_BUCKETS
+#define JD_IPIPE_BUCKETS 8
+#endif
+
 #ifndef JD_DEVICESCRIPT
 #define JD_DEVICESCRIPT JD_CLIENT
 #endif
@@ -155,6 +219,15 @@ int jd_net_send_frame(void *frame);
 #define JD_RX_QUEUE JD_SEND_FRAME
 #endif
 
+// receive frames from UART directly into a slot in the RX queue, instead of a static buffer
+#ifndef JD_RX_ZERO_COPY
+#define JD_RX_ZERO_COPY 0
+#endif
+
+#if JD_RX_ZERO_COPY && !JD_RX_QUEUE
+#error "JD_RX_ZERO_COPY requires JD_RX_QUEUE"
+#endif
+
 #if JD_DEVICESCRIPT
 
 #ifndef JD_SEND_FRAME_SIZE
@@ -185,6 +258,47 @@ int jd_net_send_frame(void *frame);
 
 #endif
 
+// with JD_RX_ZERO_COPY loopback frames are queued separately
+#ifndef JD_RX_LOOPBACK_QUEUE_SIZE
+#define JD_RX_LOOPBACK_QUEUE_SIZE 512
+#endif
+
+// hold packets from jd_send() for up to this long, so that more of them share one frame
+// (and its header); 0 means the frame is sent at the end of every jd_services_tick()
+// events, CRC ACKs and packets from services with JD_SRV_FLAG_URGENT are never held
+#ifndef JD_TX_COALESCE_US
+#define JD_TX_COALESCE_US 0
+#endif
+
+// with JD_TX_COALESCE_US, send the frame anyway once it's that many percent full
+#ifndef JD_TX_COALESCE_FILL
+#define JD_TX_COALESCE_FILL 75
+#endif
+
+// separate send queues for control/CRC ACK, event, register and bulk (pipe) frames;
+// jd_tx_get_frame() always picks the highest-priority non-empty one
+#ifndef JD_TX_PRIORITY_LANES
+#define JD_TX_PRIORITY_LANES 0
+#endif
+
+#if JD_TX_PRIORITY_LANES && !JD_SEND_FRAME
+#error "JD_TX_PRIORITY_LANES requires JD_SEND_FRAME"
+#endif
+
+// lane sizes; each should be at least 512 to always fit a full-size frame
+#ifndef JD_TX_LANE_CTRL_SIZE
+#define JD_TX_LANE_CTRL_SIZE 512
+#endif
+#ifndef JD_TX_LANE_EVENTS_SIZE
+#define JD_TX_LANE_EVENTS_SIZE 512
+#endif
+#ifndef JD_TX_LANE_REGS_SIZE
+#define JD_TX_LANE_REGS_SIZE JD_SEND_FRAME_SIZE
+#endif
+#ifndef JD_TX_LANE_BULK_SIZE
+#define JD_TX_LANE_BULK_SIZE JD_SEND_FRAME_SIZE
+#endif
+
 #ifndef JD_LORA
 #define JD_LORA 0
 #endif
@@ -205,6 +319,11 @@ int jd_net_send_frame(void *frame);
 #define JD_LSTORE JD_CLIENT
 #endif
 
+// slice-by-8 jd_crc32() (7k of extra tables), mostly for lstore; MCU lstore builds can opt in
+#ifndef JD_CRC32_SLICE8
+#define JD_CRC32_SLICE8 JD_64
+#endif
+
 #ifndef JD_HAS_PWM_ENABLE
 #define JD_HAS_PWM_ENABLE 1
 #endif
@@ -225,10 +344,6 @@ int jd_net_send_frame(void *frame);
 #define JD_ERROR_BLINK(x) ((void)0)
 #endif
 
-#ifndef JD_WAKE_MAIN
-#define JD_WAKE_MAIN() ((void)0)
-#endif
-
 #ifndef JD_INSTANCE_NAME
 #define JD_INSTANCE_NAME 0
 #endif
@@ -269,6 +384,11 @@ int jd_net_send_frame(void *frame);
 #define JD_GC_ALLOC (JD_HW_ALLOC && !JD_SIMPLE_ALLOC)
 #endif
 
+// count jd_alloc()/jd_free() calls in jd_alloc_stats; see interfaces/jd_alloc.h
+#ifndef JD_ALLOC_STATS
+#define JD_ALLOC_STATS 0
+#endif
+
 // If not JD_HW_ALLOC, how big should be the GC block(s)
 #ifndef JD_GC_KB
 #define JD_GC_KB 64
@@ -296,6 +416,28 @@ int jd_net_send_frame(void *frame);
 
 #define JD_THR_ANY (JD_THR_PTHREAD || JD_THR_AZURE_RTOS || JD_THR_FREE_RTOS)
 
+// upper bound on the main loop sleep when no timer of the stack is due (in us);
+// the pthread worker is woken up on frame reception, so it doesn't need to poll every 10ms
+// define as JD_MIN_MAX_SLEEP to get JD_CLIENT_EV_PROCESS at a steady cadence
+#ifndef JD_IDLE_MAX_SLEEP
+#define JD_IDLE_MAX_SLEEP (JD_THR_PTHREAD ? 1000000 : JD_MIN_MAX_SLEEP)
+#endif
+
+// called when there's new work for the main loop (eg. a frame was received)
+#ifndef JD_WAKE_MAIN
+#if JD_THR_ANY
+void jd_thr_wake_main(void);
+#define JD_WAKE_MAIN() jd_thr_wake_main()
+#else
+#define JD_WAKE_MAIN() ((void)0)
+#endif
+#endif
+
+// events per hclient waiting for the callback thread; when full, the oldest one is dropped
+#ifndef JDC_EVENT_QUEUE_SIZE
+#define JDC_EVENT_QUEUE_SIZE 8
+#endif
+
 // settings stuff
 #ifndef JD_SETTINGS_LARGE
 #define JD_SETTINGS_LARGE JD_DEVICESCRIPT
@@ -19,6 +19,12 @@ typedef struct jdc_client *jdc_t;
 #define JDC_TIMEOUT_DEFAULT 200 // TODO make it less?
 #define JDC_TIMEOUT_FOREVER 0xffffffff
 
+// cache_policy for jdc_get_register(): maximum age in ms of a cached register value
+// that can be returned without querying the server again (the age is counted from the query)
+#define JDC_CACHE_REFRESH 0 // always query, and wait for a fresh value
+#define JDC_CACHE_DEFAULT 50
+#define JDC_CACHE_FOREVER 0xffffffff // any value received so far is good
+
 #define JDC_WRITE_FLAG_NONE 0x0000
 #define JDC_WRITE_FLAG_REQUIRE_ACK 0x0001
 #define JDC_READ_FLAG_NONE 0x0000
@@ -33,6 +39,7 @@ typedef struct jdc_client *jdc_t;
 #define JDC_EV_ACTION_REPORT 0x0012
 #define JDC_EV_READING 0x0013 // JDC_EV_REG_VALUE will be fired as well
 
+// 'pkt' is a copy, only valid until the callback returns (use jdc_dup_pkt() to keep it)
 typedef struct {
     uint16_t code;
     uint16_t subcode;
@@ -62,6 +69,8 @@ void jdc_set_streaming(jdc_t c, bool enabled);
 void jdc_set_userdata(jdc_t c, void *userdata);
 void *jdc_get_userdata(jdc_t c);
 
+// pending jdc_get_register() calls return JDC_STATUS_UNBOUND; no other thread can be starting
+// new calls on the client
 void jdc_destroy(jdc_t c);
 
 int jdc_get_binding_info(jdc_t c, uint64_t *device_id, uint8_t *service_index);
@@ -73,6 +82,9 @@ bool jdc_is_bound(jdc_t c);
 // This calls can block
 //
 
+// With JDC_TIMEOUT_IMMEDIATE_ONLY read timeout, this never blocks - it returns the cached value
+// if any (regardless of cache_policy; a refresh is requested in background), or JDC_STATUS_TIMEOUT.
+// If the response is shorter than size, the rest of dst is zeroed.
 int jdc_get_register(jdc_t c, uint16_t regcode, void *dst, unsigned size, unsigned cache_policy);
 int jdc_get_register_float(jdc_t c, uint16_t regcode, jd_float_t *dst, unsigned numfmt, unsigned cache_policy);
 int jdc_set_register(jdc_t c, uint16_t regcode, const void *payload, unsigned size);
@@ -104,8 +116,13 @@ void jdc_run_and_wait(jdc_generic_cb_t cb, void *userdata);
 // The timeout only applies to waiting for events, the handlers can take longer to execute.
 // Returns number of event handlers run.
 // Return value of 0 implies timeout_ms elapsed without any incoming events.
+// Only one thread can be running this at a time (it's the callback thread after
+// jdc_start_threads()).
 int jdc_process_events(unsigned timeout_ms);
 
+// Copy of the packet (in a separate jd_alloc() block); free with jd_free().
+jd_packet_t *jdc_dup_pkt(jd_packet_t *pkt);
+
 #if 0
 // generated client code will look something like this
 typedef struct {
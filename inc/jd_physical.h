@@ -42,6 +42,9 @@ extern "C" {
 #define JD_PIPE_CLOSE_MASK 0x0020
 #define JD_PIPE_METADATA_MASK 0x0040
 #define JD_PIPE_PORT_SHIFT 7
+// pipe packets sent but not CRC-ACKed yet span at most that many counter values, so that
+// re-transmissions and packets ahead of the expected one can be told apart by the 5-bit counter
+#define JD_PIPE_MAX_IN_FLIGHT 15
 
 #define JD_CMD_EVENT_MASK 0x8000
 #define JD_CMD_EVENT_CODE_MASK 0xff
@@ -98,6 +101,10 @@ bool jd_frame_crc_ok(jd_frame_t *frame);
 void jd_tx_completed(int errCode);
 void jd_rx_completed(int dataLeft);
 void jd_line_falling(void);
+#if JD_RX_INCREMENTAL_CRC
+// optional; called (from IRQ) as data is received, once the first `numbytes` are in RAM
+void jd_rx_progress(uint32_t numbytes);
+#endif
 int jd_is_running(void);
 int jd_is_busy(void);
 
@@ -109,6 +116,7 @@ typedef struct {
     uint32_t packets_sent;
     uint32_t packets_received;
     uint32_t packets_dropped;
+    uint32_t event_retx_dropped; // event re-transmissions skipped due to event queue overflow
 } jd_diagnostics_t;
 jd_diagnostics_t *jd_get_diagnostics(void);
 
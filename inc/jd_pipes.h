@@ -11,27 +11,79 @@
 
 #define JD_OPIPE_MAX_RETRIES 4
 
-// note that this is around 260 bytes
+// Retry timeout is computed from smoothed round-trip time (send to CRC-ACK) like in TCP
+// (RFC 6298), and doubled on each re-transmission; it starts at JD_OPIPE_INITIAL_RTO_US.
+// Frames that were re-transmitted are not measured (Karn's rule); instead the timeout is
+// doubled for next frames, once for all frames that were first sent with the same timeout.
+#ifndef JD_OPIPE_INITIAL_RTO_US
+#define JD_OPIPE_INITIAL_RTO_US 8192
+#endif
+#ifndef JD_OPIPE_MIN_RTO_US
+#define JD_OPIPE_MIN_RTO_US 2048
+#endif
+#ifndef JD_OPIPE_MAX_RTO_US
+#define JD_OPIPE_MAX_RTO_US (256 * 1024)
+#endif
+// frames in flight; independently, at most JD_PIPE_MAX_IN_FLIGHT packets are in flight,
+// so a window of 8 is only filled with one packet per frame (writes over 114 bytes),
+// and a window of 4 with up to 3 packets per frame (writes over 74 bytes)
+#define JD_OPIPE_MAX_WINDOW 8
+
+// a frame in flight
+typedef struct jd_opipe_slot {
+    uint8_t curr_retry;
+    uint8_t first_counter; // of the first packet in frame
+    uint32_t retry_time;
+    uint32_t sent_time; // of the first transmission
+    uint32_t rto;       // in effect at the first transmission; retries back off from it
+    jd_frame_t frame;
+} jd_opipe_slot_t;
+
+// note that this is around 290 bytes
 typedef struct jd_opipe_desc {
     // don't access members directly
     struct jd_opipe_desc *next;
     uint16_t counter;
     uint8_t status;
-    uint8_t curr_retry;
-    uint32_t retry_time;
-    jd_frame_t frame;
+    uint8_t window_size;
+    // smoothed RTT and its variation, and retransmission timeout, in us
+    // srtt == 0 until first measurement
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    jd_opipe_slot_t *window;
+    // frame being filled; without a window also the one in flight
+    jd_opipe_slot_t main;
 } jd_opipe_desc_t;
 
 int jd_opipe_open(jd_opipe_desc_t *str, uint64_t device_id, uint16_t port_num);
 int jd_opipe_open_cmd(jd_opipe_desc_t *str, jd_packet_t *cmd_pkt);
 int jd_opipe_open_report(jd_opipe_desc_t *str, jd_packet_t *report_pkt);
+// Call after open, before first write, to allow up to num_slots frames (each retried separately)
+// to be waiting for ACK, instead of one. `slots` has to be kept alive until the pipe is closed.
+// The receiver has to accept frames out of order (in case one is lost and re-transmitted);
+// jd_ipipe_* does with JD_IPIPE_REORDER and jd_ipipe_allow_reorder(), for any packet the sender
+// can have in flight (see JD_PIPE_MAX_IN_FLIGHT).
+int jd_opipe_set_window(jd_opipe_desc_t *str, jd_opipe_slot_t *slots, unsigned num_slots);
 
-// all these functions can return JD_PIPE_TRY_AGAIN
+// all these functions can return JD_PIPE_TRY_AGAIN; this includes the case when the packet
+// would be JD_PIPE_MAX_IN_FLIGHT or more ahead of the oldest one not CRC-ACKed yet
 // can be optionally called before jd_opipe_write*(); if this return JD_PIPE_OK, then write also
 // will
 int jd_opipe_check_space(jd_opipe_desc_t *str, unsigned len);
 int jd_opipe_write(jd_opipe_desc_t *str, const void *data, unsigned len);
 int jd_opipe_write_meta(jd_opipe_desc_t *str, const void *data, unsigned len);
+// writes a single packet, concatenating the buffers
+typedef struct {
+    const void *data;
+    unsigned len;
+} jd_opipe_iovec_t;
+int jd_opipe_writev(jd_opipe_desc_t *str, const jd_opipe_iovec_t *iov, unsigned iovcnt);
+// Get space for a packet of up to `len` bytes directly in the pipe frame, and set *dst to it.
+// Fill it, and call jd_opipe_commit() with the actual length (at most `len`), before any other
+// call on the pipe. Not committing is fine - the space is not used.
+int jd_opipe_reserve(jd_opipe_desc_t *str, unsigned len, void **dst);
+int jd_opipe_commit(jd_opipe_desc_t *str, unsigned len);
 // flush is automatic when buffer full, or on close
 int jd_opipe_flush(jd_opipe_desc_t *str);
 // it's OK to closed a closed stream
@@ -52,8 +104,20 @@ struct jd_ipipe_desc {
     jd_ipipe_handler_t meta_handler;
     struct jd_ipipe_desc *next;
     uint16_t counter;
+#if JD_IPIPE_REORDER
+    bool reorder_allowed;
+    // packets that arrived ahead of the expected one, indexed by their counter;
+    // allocated on first such packet; jd_frame_t is big enough for any packet
+    uint16_t reorder_mask;
+    jd_frame_t *reorder;
+#endif
 };
 int jd_ipipe_open(jd_ipipe_desc_t *str, jd_ipipe_handler_t handler,
                   jd_ipipe_handler_t meta_handler);
+// Call after open, when the sender is known to use jd_opipe_set_window() (and thus keep at most
+// JD_PIPE_MAX_IN_FLIGHT packets not CRC-ACKed). Packets ahead of the expected one are then kept,
+// instead of dropped. Other senders may re-transmit frames with more packets than that, and
+// their old packets would look like future ones. Does nothing without JD_IPIPE_REORDER.
+void jd_ipipe_allow_reorder(jd_ipipe_desc_t *str);
 void jd_ipipe_close(jd_ipipe_desc_t *str);
 void jd_ipipe_handle_packet(jd_packet_t *pkt);
@@ -70,6 +70,10 @@ typedef struct _srv_vt srv_vt_t;
     uint8_t srv_flags;
 #define REG_SRV_COMMON REG_BYTES(JD_REG_PADDING, JD_PTRSIZE + 2)
 
+// srv_flags
+// packets from this service are sent at the end of the tick, regardless of JD_TX_COALESCE_US
+#define JD_SRV_FLAG_URGENT 0x01
+
 struct srv_state_common {
     SRV_COMMON;
 };
@@ -78,6 +82,11 @@ typedef struct srv_state_common srv_common_t;
 
 srv_t *jd_allocate_service(const srv_vt_t *vt);
 
+/**
+ * Returns service at given index, or NULL if there is no such service.
+ */
+srv_t *jd_service_by_index(unsigned service_index);
+
 /**
  * Interprets packet as a register read/write, based on REG_DEFINITION() passed as 'sdesc'.
  * It will either read from or write to 'state', depending on register.
@@ -112,6 +121,15 @@ void jd_services_init(void);
  */
 void jd_services_deinit(void);
 
+#if JD_64 && JD_CLIENT && JD_SEND_FRAME
+/**
+ * Benchmark of send/loopback/receive pipeline, see jd_bench.c.
+ * jd_bench_init() is to be called from app_init_services().
+ */
+void jd_bench_init(void);
+void jd_bench_run(void);
+#endif
+
 /**
  * Called by jd_process_everything()
  **/
@@ -0,0 +1,79 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include "jd_protocol.h"
+
+#if JD_SIM
+
+//
+// Deterministic, discrete-event simulation of a Jacdac bus.
+//
+// This implements the bus, timer and IRQ parts of interfaces/jd_hw.h (uart_*, tim_*,
+// target_*_irq()) against a simulated single-wire medium. The local node runs the real
+// jd_physical.c state machine. The other nodes on the bus are modelled peers, which generate
+// frames and arbitrate the line using the same rules as jd_physical.c (wait for idle line,
+// then jd_random_around(150) us back-off before pulling the line low).
+//
+// Time is virtual - tim_get_micros() returns the simulation clock, which only advances
+// in jd_sim_run*() (and target_wait_us()).
+//
+
+#ifndef JD_SIM_MAX_PEERS
+#define JD_SIM_MAX_PEERS 63
+#endif
+
+// break (low pulse) length, and gap between end of break and first data byte
+#define JD_SIM_LO_PULSE_US 11
+#define JD_SIM_DATA_GAP_US 50
+// 1Mbaud, 8N1
+#define JD_SIM_BYTE_US 10
+// a node can't see the line going low for this long after another node pulled it low;
+// transmissions started within this window collide
+#define JD_SIM_SENSE_US 2
+// with JD_RX_INCREMENTAL_CRC, jd_rx_progress() is called every that many bytes
+#define JD_SIM_RX_CHUNK 16
+
+typedef struct {
+    uint8_t num_peers;
+    // size of the (single) packet payload in frames sent by peers; 0..JD_SERIAL_PAYLOAD_SIZE
+    uint8_t peer_payload_size;
+    // average time between frames generated by a single peer
+    uint32_t peer_interval_us;
+    // seeds both the simulation and jd_random()
+    uint32_t seed;
+} jd_sim_config_t;
+
+typedef struct {
+    uint64_t elapsed_us;
+    uint64_t bus_busy_us;
+
+    // all transmissions on the wire
+    uint32_t frames_started;
+    uint32_t frames_collided;
+
+    // frames sent by the local (jd_physical.c) node
+    uint32_t local_tx;
+    uint32_t local_tx_collided;
+    uint32_t local_tx_busy; // uart_start_tx() refused due to busy line
+
+    // frames generated by peers
+    uint32_t peer_generated;
+    uint32_t peer_sent;          // made it to the wire without collision
+    uint32_t peer_dropped;       // peer queue overflow
+    uint64_t peer_latency_sum;   // generation -> end of successful transmission
+    uint32_t peer_latency_max;
+    uint32_t local_rx_delivered; // peer frames handed to jd_rx_completed() without error
+} jd_sim_stats_t;
+
+// call before jd_init()
+void jd_sim_init(const jd_sim_config_t *cfg);
+// dispatch bus and timer events until virtual clock reaches `until`
+void jd_sim_run_until(uint64_t until);
+// run for `duration_us`, calling jd_process_everything() every `main_period_us`
+void jd_sim_run(uint32_t duration_us, uint32_t main_period_us);
+const jd_sim_stats_t *jd_sim_get_stats(void);
+void jd_sim_print_stats(void);
+
+#endif
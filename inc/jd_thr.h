@@ -10,7 +10,8 @@
 #if JD_THR_PTHREAD
 #include <pthread.h>
 typedef pthread_mutex_t jd_mutex_t;
-typedef pthread_t jd_thread_t;
+// per-thread record with the condition used for suspend/resume
+typedef struct jd_thread *jd_thread_t;
 
 #elif JD_THR_AZURE_RTOS
 #error "TODO"
@@ -39,8 +40,19 @@ void jd_thr_destroy_mutex(jd_mutex_t *mutex);
 void jd_thr_lock(jd_mutex_t *mutex);
 void jd_thr_unlock(jd_mutex_t *mutex);
 
+// held by the process worker while in jd_process_everything();
+// other threads need to hold it while calling into the client (routing, roles) code; recursive
+void jd_thr_lock_main(void);
+void jd_thr_unlock_main(void);
+
 jd_thread_t jd_thr_self(void);
+// jd_thr_resume() called before jd_thr_suspend_self*() is not lost - the suspend returns
+// immediately; the callers should re-check whatever condition they're waiting for
 void jd_thr_suspend_self(void);
+// returns 0 when resumed, or -1 when timeout_ms elapsed
+int jd_thr_suspend_self_timeout(unsigned timeout_ms);
+// the handle of a thread that has exited can still be passed here (the record is recycled,
+// not freed) - this may spuriously wake up another thread
 void jd_thr_resume(jd_thread_t t);
 
 #endif
\ No newline at end of file
@@ -15,6 +15,12 @@ void jd_seed_random(uint32_t s);
 uint32_t jd_hash_fnv1a(const void *data, unsigned len);
 // CRC-16-CCITT polynomial 0x1021
 uint16_t jd_crc16(const void *data, uint32_t size);
+// continue computing CRC; jd_crc16(d, n) == jd_crc16_update(0xffff, d, n)
+uint16_t jd_crc16_update(uint16_t crc, const void *data, uint32_t size);
+#if JD_CRC16_HW
+// weak, defaults to software implementation; override when there's a CRC peripheral
+uint16_t jd_crc16_hw(const void *data, uint32_t size);
+#endif
 // CRC-32 ISO 3309 polynomial 0x04C11DB7
 uint32_t jd_crc32(const void *data, uint32_t size);
 
@@ -63,6 +69,15 @@ static inline bool in_future_ms(uint32_t moment) {
 bool jd_should_sample_ms(uint32_t *sample, uint32_t period);
 #endif
 
+// Sorted index of up to 256 items, eg. services by service class.
+// jd_index_sort() sets index[i] to 0..n-1, stable-sorted by key(ctx, i).
+// jd_index_lower_bound() returns the first position p, such that key(ctx, index[p]) >= k
+// (or n, if there's none).
+typedef uint32_t (*jd_index_key_t)(void *ctx, unsigned idx);
+void jd_index_sort(uint8_t *index, unsigned n, jd_index_key_t key, void *ctx);
+unsigned jd_index_lower_bound(const uint8_t *index, unsigned n, uint32_t k, jd_index_key_t key,
+                              void *ctx);
+
 // sizeof(dst) == len*2 + 1
 void jd_to_hex(char *dst, const void *src, size_t len);
 // sizeof(dst) >= strlen(dst)/2; returns length of dst
@@ -128,9 +143,17 @@ __attribute__((noreturn)) void jd_panic_core(const char *file, unsigned line, co
 typedef struct jd_queue *jd_queue_t;
 jd_queue_t jd_queue_alloc(unsigned size);
 int jd_queue_push(jd_queue_t q, jd_frame_t *pkt);
+// lock-free; only safe when called from a single context (eg. the UART ISR), with any
+// other producers using jd_queue_push() from a lower priority context
+int jd_queue_push_nolock(jd_queue_t q, jd_frame_t *pkt);
+// in-place push: reserve space for up to `size` bytes, fill it, and commit; see jd_queue.c
+jd_frame_t *jd_queue_reserve(jd_queue_t q, unsigned size);
+void jd_queue_commit(jd_queue_t q, jd_frame_t *pkt);
 jd_frame_t *jd_queue_front(jd_queue_t q);
 void jd_queue_shift(jd_queue_t q);
 void jd_queue_test(void);
+void jd_crc16_bench(void);
+void jd_crc32_bench(void);
 int jd_queue_will_fit(jd_queue_t q, unsigned size);
 void jd_queue_clear(jd_queue_t q);
 
@@ -145,14 +168,26 @@ int jd_bqueue_push(jd_bqueue_t q, const void *data, unsigned len);
 int jd_bqueue_pop_atomic(jd_bqueue_t q, void *dst, unsigned size);
 // returns number of bytes popped
 unsigned jd_bqueue_pop_at_most(jd_bqueue_t q, void *dst, unsigned maxsize);
-// returns -1 when empty
+// returns -1 when empty; prefer jd_bqueue_pop_at_most() or jd_bqueue_peek() for more than a byte
 int jd_bqueue_pop_byte(jd_bqueue_t q);
+// skip the IRQ masking in push/pop; only safe with a single producer and a single consumer
+void jd_bqueue_set_spsc(jd_bqueue_t q, bool spsc);
+// Zero-copy access for the (single) consumer: fills in the two contiguous regions of queued data
+// (seg[1] is empty unless the data wraps around) and returns their total length.
+// The regions stay valid until jd_bqueue_consume(), which drops `sz` bytes from the front.
+typedef struct {
+    uint8_t *data;
+    unsigned len;
+} jd_bqueue_seg_t;
+unsigned jd_bqueue_peek(jd_bqueue_t q, jd_bqueue_seg_t seg[2]);
+void jd_bqueue_consume(jd_bqueue_t q, unsigned sz);
 // low-level, not thread-safe interface
 unsigned jd_bqueue_available_cont_data(jd_bqueue_t q);
 uint8_t *jd_bqueue_cont_data_ptr(jd_bqueue_t q);
 void jd_bqueue_cont_data_advance(jd_bqueue_t q, unsigned sz);
 void jd_bqueue_print(jd_bqueue_t q, void (*print_fn)(char ch));
 void jd_bqueue_clear(jd_bqueue_t q);
+void jd_bqueue_test(void);
 
 void jd_utoa(unsigned k, char *s);
 void jd_itoa(int n, char *s);
@@ -0,0 +1,18 @@
+#pragma once
+
+// configuration for the jd_sim host executable (see main.c)
+
+#include <stdio.h>
+
+#define JD_SIM 1
+#define JD_PHYSICAL 1
+#define JD_CONFIG_STATUS 0
+#define JD_CONFIG_CONTROL_FLOOD 0
+#define JD_SIMPLE_ALLOC 0
+#define JD_SEND_FRAME 1
+#define JD_VERBOSE_ASSERT 1
+// client/*.c are built into the library, and need it
+#define JD_MS_TIMER 1
+#define JD_LOG(...) ((void)0)
+#define DMESG(fmt, ...) printf(fmt "\n", ##__VA_ARGS__)
+#define JD_FLASH_PAGE_SIZE 4096
@@ -0,0 +1,72 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Host driver for the bus simulator (source/jd_sim.c): runs the full stack against
+// a number of simulated peers and prints bus and stack statistics.
+//
+// usage: jd_sim [num_peers [peer_interval_us [duration_ms]]]
+
+#include "jd_sim.h"
+#include <stdlib.h>
+
+uint32_t now;
+const char app_dev_class_name[] = "jd_sim";
+const char app_fw_version[] = "v0.0.0";
+uint8_t jd_connected_blink;
+
+void app_init_services(void) {}
+
+uint32_t app_get_device_class(void) {
+    return 0x3ffffff1;
+}
+
+uint64_t hw_device_id(void) {
+    return 0x5100c0ffee000000ULL;
+}
+
+void hw_panic(void) {
+    DMESG("PANIC");
+    abort();
+}
+
+void target_reset(void) {
+    exit(1);
+}
+
+void *(jd_alloc)(uint32_t size) {
+    void *r = calloc(1, size);
+    if (!r)
+        hw_panic();
+    return r;
+}
+
+void (jd_free)(void *ptr) {
+    free(ptr);
+}
+
+void jd_alloc_init(void) {}
+void jd_alloc_stack_check(void) {}
+
+// no status LED or power control
+void jd_blink(uint8_t encoded) {}
+void jd_glow(uint32_t glow) {}
+void power_pin_enable(int en) {}
+
+int main(int argc, char **argv) {
+    jd_sim_config_t cfg = {
+        .num_peers = argc > 1 ? atoi(argv[1]) : 16,
+        .peer_payload_size = 16,
+        .peer_interval_us = argc > 2 ? atoi(argv[2]) : 10000,
+        .seed = 42,
+    };
+    unsigned duration_ms = argc > 3 ? atoi(argv[3]) : 2000;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // jd_physical.c state can't be reset, so it's one scenario per run
+    jd_sim_init(&cfg);
+    jd_init();
+    jd_sim_run(duration_ms * 1000, 1000);
+    jd_sim_print_stats();
+    return 0;
+}
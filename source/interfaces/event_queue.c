@@ -3,31 +3,140 @@
 
 #include "jd_protocol.h"
 
-#define FIRST_DELAY 20  // first repetition send after N ms
-#define SECOND_DELAY 50 // second sent after additional N ms
+// Events are kept in a ring buffer, in the order they were sent.
+// Each event carries the time of its next re-transmission and the number of re-transmissions
+// left; once that reaches zero, the event is marked as done and is removed when it reaches
+// the head of the ring.
+// Schedules differ between services, so events don't come due in the order they were sent;
+// pending events are also kept in a binary min-heap by re-transmission time, so only
+// the events that are due are looked at, each in O(log n).
+// When an event doesn't fit at the end of the buffer, a wrap marker is written (if there is room
+// for ev_t header) and the event goes at the start.
+// When the buffer is full, the oldest event is dropped.
+
+#define EV_WRAP 0xff
+#define EV_DONE 0xfe
+// max. number of events in buffer; heap_idx has to fit
+#define EV_MAX (JD_EVENT_QUEUE_SIZE / sizeof(ev_t))
 
 typedef struct {
     uint32_t timestamp;
     uint8_t service_size;
     uint8_t service_index;
     uint16_t service_command;
+    uint8_t repeats_left;
+    uint8_t heap_idx; // position in info.heap, if not done
+    uint8_t reserved[2];
     uint8_t data[0];
 } ev_t;
+STATIC_ASSERT(EV_MAX <= 256);
 
 struct event_info {
-    ev_t *buffer;
+    uint8_t *buffer;
+    // offsets in buffer of events not done, ordered by timestamp
+    uint16_t *heap;
+    uint16_t heap_size;
     cb_t process;
-    uint16_t qptr;
+    const jd_event_schedule_t **schedules;
+    uint16_t head, tail;
+    uint16_t num_events;
     uint8_t counter;
+#if JD_EVENT_ADAPTIVE && JD_PHYSICAL
+    int8_t extra_repeats;
+    uint32_t adapt_sample;
+    uint32_t prev_errors, prev_received;
+#endif
 };
 static struct event_info info;
 
+static const jd_event_schedule_t default_schedule = {
+    .repeats = JD_EVENT_REPEATS,
+    .first_delay_ms = JD_EVENT_FIRST_DELAY_MS,
+    .delay_ms = JD_EVENT_DELAY_MS,
+};
+
 static inline uint32_t ev_size(ev_t *ev) {
     return sizeof(ev_t) + ((ev->service_size + 3) & ~3);
 }
 
-static inline ev_t *next_ev(ev_t *ev) {
-    return (ev_t *)((uint8_t *)ev + ev_size(ev));
+// event at *pos, following a wrap if any
+static ev_t *ev_at(uint16_t *pos) {
+    if (*pos + sizeof(ev_t) > JD_EVENT_QUEUE_SIZE ||
+        ((ev_t *)(info.buffer + *pos))->service_index == EV_WRAP)
+        *pos = 0;
+    return (ev_t *)(info.buffer + *pos);
+}
+
+static inline ev_t *heap_ev(unsigned i) {
+    return (ev_t *)(info.buffer + info.heap[i]);
+}
+
+static void heap_set(unsigned i, uint16_t off) {
+    info.heap[i] = off;
+    heap_ev(i)->heap_idx = i;
+}
+
+static void heap_sift_up(unsigned i) {
+    uint16_t off = info.heap[i];
+    uint32_t t = ((ev_t *)(info.buffer + off))->timestamp;
+    while (i > 0) {
+        unsigned p = (i - 1) / 2;
+        if (!is_before(t, heap_ev(p)->timestamp))
+            break;
+        heap_set(i, info.heap[p]);
+        i = p;
+    }
+    heap_set(i, off);
+}
+
+static void heap_sift_down(unsigned i) {
+    uint16_t off = info.heap[i];
+    uint32_t t = ((ev_t *)(info.buffer + off))->timestamp;
+    for (;;) {
+        unsigned c = 2 * i + 1;
+        if (c >= info.heap_size)
+            break;
+        if (c + 1 < info.heap_size && is_before(heap_ev(c + 1)->timestamp, heap_ev(c)->timestamp))
+            c++;
+        if (!is_before(heap_ev(c)->timestamp, t))
+            break;
+        heap_set(i, info.heap[c]);
+        i = c;
+    }
+    heap_set(i, off);
+}
+
+static void heap_push(uint16_t off) {
+    JD_ASSERT(info.heap_size < EV_MAX);
+    info.heap[info.heap_size] = off;
+    heap_sift_up(info.heap_size++);
+}
+
+static void heap_remove(unsigned i) {
+    JD_ASSERT(i < info.heap_size);
+    if (--info.heap_size == i)
+        return;
+    uint16_t off = info.heap[info.heap_size];
+    info.heap[i] = off;
+    heap_sift_up(i);
+    heap_sift_down(((ev_t *)(info.buffer + off))->heap_idx);
+}
+
+static const jd_event_schedule_t *get_schedule(unsigned service_index) {
+    if (info.schedules && info.schedules[service_index])
+        return info.schedules[service_index];
+    return &default_schedule;
+}
+
+void jd_event_set_schedule(srv_t *srv, const jd_event_schedule_t *sched) {
+    unsigned idx = ((srv_common_t *)srv)->service_index;
+    JD_ASSERT(idx < JD_MAX_SERVICES);
+    if (!info.schedules) {
+        if (!sched)
+            return;
+        info.schedules = jd_alloc(sizeof(void *) * JD_MAX_SERVICES);
+    }
+    info.schedules[idx] = sched;
 }
 
 static uint16_t next_event_cmd(uint32_t eventid) {
@@ -37,46 +146,114 @@ static uint16_t next_event_cmd(uint32_t eventid) {
     return JD_CMD_EVENT_MK(info.counter, eventid);
 }
 
-static void ev_shift(void) {
-    int offset = ev_size(info.buffer);
-    info.qptr -= offset;
-    jd_word_move(info.buffer, (uint8_t *)info.buffer + offset, info.qptr);
+static void ev_drop_head(void) {
+    ev_t *ev = ev_at(&info.head);
+    if (ev->service_index != EV_DONE) {
+        heap_remove(ev->heap_idx);
+#if JD_PHYSICAL
+        jd_get_diagnostics()->event_retx_dropped += ev->repeats_left;
+#endif
+    }
+    info.head += ev_size(ev);
+    info.num_events--;
+}
+
+// returns offset where an event of `size` bytes can be written, or -1 if it doesn't fit
+static int ev_find_space(unsigned size) {
+    if (info.num_events == 0) {
+        info.head = info.tail = 0;
+        return 0;
+    }
+    unsigned head = info.head, tail = info.tail;
+    if (head < tail) {
+        if (tail + size <= JD_EVENT_QUEUE_SIZE)
+            return tail;
+        if (size <= head)
+            return 0;
+    } else if (tail < head) {
+        if (tail + size <= head)
+            return tail;
+    }
+    // head == tail and not empty - full
+    return -1;
+}
+
+#if JD_EVENT_ADAPTIVE && JD_PHYSICAL
+// error rate thresholds in 1/1000
+#define ADAPT_QUIET 5
+#define ADAPT_NOISY 50
+#define ADAPT_VERY_NOISY 200
+#define ADAPT_MIN_PACKETS 32
+
+static void ev_adapt(void) {
+    if (!jd_should_sample(&info.adapt_sample, JD_EVENT_ADAPTIVE_PERIOD_MS * 1000))
+        return;
+    jd_diagnostics_t *d = jd_get_diagnostics();
+    uint32_t errors = d->bus_uart_error + d->packets_dropped;
+    uint32_t num_err = errors - info.prev_errors;
+    uint32_t total = d->packets_received - info.prev_received + num_err;
+    if (total < ADAPT_MIN_PACKETS)
+        return; // not enough traffic to tell; keep sampling
+    info.prev_errors = errors;
+    info.prev_received = d->packets_received;
+    uint32_t rate = num_err * 1000 / total;
+    info.extra_repeats = rate < ADAPT_QUIET         ? -1
+                         : rate < ADAPT_NOISY      ? 0
+                         : rate < ADAPT_VERY_NOISY ? 1
+                                                   : 2;
+}
+#endif
+
+static unsigned num_repeats(const jd_event_schedule_t *sched) {
+    int r = sched->repeats;
+#if JD_EVENT_ADAPTIVE && JD_PHYSICAL
+    // services that don't want re-transmissions don't get them
+    if (r > 0) {
+        r += info.extra_repeats;
+        if (r < 1)
+            r = 1;
+    }
+#endif
+    if (r > JD_EVENT_MAX_REPEATS)
+        r = JD_EVENT_MAX_REPEATS;
+    return r;
 }
 
 static void do_process_event_queue(void) {
     // if info.process != NULL, then info.buffer has been initialized already
-    ev_t *ev = info.buffer;
-    while ((uint8_t *)ev - (uint8_t *)info.buffer < info.qptr) {
-        if (ev->service_index == 0xff) {
-            if (ev == info.buffer) {
-                ev_shift();
-                continue;
-            }
-        } else if (in_past(ev->timestamp)) {
-            if (jd_send(ev->service_index & 0x7f, ev->service_command, ev->data,
-                        ev->service_size) != 0)
-                break;
-            if (ev->service_index & 0x80) {
-                if (ev == info.buffer) {
-                    ev_shift();
-                    continue;
-                } else {
-                    ev->service_index = 0xff; // not sure this can happen
-                }
-            } else {
-                ev->timestamp += SECOND_DELAY * 1000;
-                ev->service_index |= 0x80;
-            }
-        }
+#if JD_EVENT_ADAPTIVE && JD_PHYSICAL
+    ev_adapt();
+#endif
 
-        ev = next_ev(ev);
+    while (info.heap_size) {
+        ev_t *ev = heap_ev(0);
+        if (!in_past(ev->timestamp)) {
+            jd_set_max_sleep(ev->timestamp - now);
+            break;
+        }
+        if (jd_send(ev->service_index, ev->service_command, ev->data, ev->service_size) != 0) {
+            // give the TX queue a moment to drain
+            jd_set_max_sleep(1000);
+            break;
+        }
+        if (--ev->repeats_left == 0) {
+            ev->service_index = EV_DONE;
+            heap_remove(0);
+        } else {
+            ev->timestamp += get_schedule(ev->service_index)->delay_ms * 1000;
+            heap_sift_down(0);
+        }
     }
+
+    while (info.num_events && ev_at(&info.head)->service_index == EV_DONE)
+        ev_drop_head();
 }
 
 static void ev_init(void) {
     if (info.buffer)
         return;
     info.buffer = jd_alloc(JD_EVENT_QUEUE_SIZE);
+    info.heap = jd_alloc(EV_MAX * sizeof(uint16_t));
     // this is only linked in, when the code uses event sending functions
     info.process = do_process_event_queue;
 }
@@ -97,20 +274,33 @@ void jd_send_event_ext(srv_t *srv, uint32_t eventid, const void *data, uint32_t
 
     ev_init();
 
-    int reqlen = data_bytes + sizeof(ev_t);
+    const jd_event_schedule_t *sched = get_schedule(state->service_index);
+    unsigned repeats = num_repeats(sched);
+    if (repeats == 0)
+        return;
+
+    int reqlen = sizeof(ev_t) + ((data_bytes + 3) & ~3);
     if (reqlen > JD_EVENT_QUEUE_SIZE)
         return; // too long to queue; shouldn't happen
-    while (JD_EVENT_QUEUE_SIZE - info.qptr < reqlen)
-        ev_shift();
 
-    ev_t *ev = (ev_t *)((uint8_t *)info.buffer + info.qptr);
+    int ptr;
+    while ((ptr = ev_find_space(reqlen)) < 0)
+        ev_drop_head();
+
+    if (ptr != info.tail && info.tail + sizeof(ev_t) <= JD_EVENT_QUEUE_SIZE)
+        ((ev_t *)(info.buffer + info.tail))->service_index = EV_WRAP;
+
+    ev_t *ev = (ev_t *)(info.buffer + ptr);
     ev->service_size = data_bytes;
     ev->service_command = cmd;
     ev->service_index = state->service_index;
+    ev->repeats_left = repeats;
     memcpy(ev->data, data, data_bytes);
     // no randomization; it's somewhat often to generate multiple events in the same tick
     // they will this way get the same re-transmission time, and thus be packed in one frame
-    // on both re-transmissions
-    ev->timestamp = now + FIRST_DELAY * 1000;
-    info.qptr += ev_size(ev);
+    // on all re-transmissions
+    ev->timestamp = now + sched->first_delay_ms * 1000;
+    info.tail = ptr + reqlen;
+    info.num_events++;
+    heap_push(ptr);
 }
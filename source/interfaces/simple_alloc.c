@@ -56,7 +56,7 @@ void jd_alloc_init(void) {
 #endif
 
 #if JD_SIMPLE_ALLOC
-void *jd_alloc(uint32_t size) {
+void *(jd_alloc)(uint32_t size) {
     // convert size from bytes to words
     size = (size + 3) >> 2;
 
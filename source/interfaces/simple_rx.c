@@ -3,8 +3,24 @@
 
 #include "jd_protocol.h"
 
+// with zero-copy RX, the UART may be receiving into a slot reserved in rx_queue,
+// so loopback frames can't be pushed there
+#define LOOP_QUEUE (JD_RX_ZERO_COPY && (JD_CLIENT || JD_BRIDGE))
+
+// on MCUs, frames from the wire come from the UART ISR, which can't be interrupted by
+// the loopback path in main loop (which masks IRQs), so the ISR can skip the lock;
+// on hosted/threaded builds frames arrive on a transport thread instead, and
+// target_disable_irq() is just a mutex, so both producers have to take it
+#define RX_NOLOCK (JD_PHYSICAL && !JD_THR_ANY)
+
 #if JD_RX_QUEUE
 static jd_queue_t rx_queue;
+#if JD_RX_ZERO_COPY
+static jd_frame_t *rx_slot;
+#endif
+#if LOOP_QUEUE
+static jd_queue_t loop_queue;
+#endif
 #else
 static uint8_t occupied;
 static jd_frame_t frameToHandle;
@@ -15,8 +31,19 @@ void jd_rx_init(void) {
     if (!rx_queue)
         rx_queue = jd_queue_alloc(JD_RX_QUEUE_SIZE);
 #endif
+#if LOOP_QUEUE
+    if (!loop_queue)
+        loop_queue = jd_queue_alloc(JD_RX_LOOPBACK_QUEUE_SIZE);
+#endif
 }
 
+#if JD_RX_ZERO_COPY
+jd_frame_t *jd_rx_reserve_frame(void) {
+    rx_slot = rx_queue ? jd_queue_reserve(rx_queue, sizeof(jd_frame_t)) : NULL;
+    return rx_slot;
+}
+#endif
+
 static int jd_rx_frame_received_core(jd_frame_t *frame, bool is_loop) {
 #ifdef JD_SERVICES_PROCESS_FRAME_PRE
     JD_SERVICES_PROCESS_FRAME_PRE(frame);
@@ -39,6 +66,21 @@ static int jd_rx_frame_received_core(jd_frame_t *frame, bool is_loop) {
 
 #if JD_RX_QUEUE
     // DMESG("PUSH %x l=%d", frame->crc, is_loop);
+#if LOOP_QUEUE
+    if (is_loop)
+        return jd_queue_push(loop_queue, frame);
+#endif
+#if JD_RX_ZERO_COPY
+    if (frame == rx_slot) {
+        rx_slot = NULL;
+        jd_queue_commit(rx_queue, frame);
+        return 0;
+    }
+#endif
+#if RX_NOLOCK
+    if (!is_loop)
+        return jd_queue_push_nolock(rx_queue, frame);
+#endif
     return jd_queue_push(rx_queue, frame);
 #else
     if (occupied)
@@ -61,6 +103,11 @@ int jd_rx_frame_received_loopback(jd_frame_t *frame) {
 
 jd_frame_t *jd_rx_get_frame(void) {
 #if JD_RX_QUEUE
+#if LOOP_QUEUE
+    jd_frame_t *frame = jd_queue_front(loop_queue);
+    if (frame)
+        return frame;
+#endif
     return jd_queue_front(rx_queue);
 #else
     return occupied ? &frameToHandle : NULL;
@@ -69,6 +116,12 @@ jd_frame_t *jd_rx_get_frame(void) {
 
 void jd_rx_release_frame(jd_frame_t *frame) {
 #if JD_RX_QUEUE
+#if LOOP_QUEUE
+    if (frame == jd_queue_front(loop_queue)) {
+        jd_queue_shift(loop_queue);
+        return;
+    }
+#endif
     jd_queue_shift(rx_queue);
 #else
     JD_ASSERT(occupied);
@@ -78,8 +131,12 @@ void jd_rx_release_frame(jd_frame_t *frame) {
 
 bool jd_rx_has_frame(void) {
 #if JD_RX_QUEUE
+#if LOOP_QUEUE
+    if (jd_queue_front(loop_queue) != NULL)
+        return true;
+#endif
     return jd_queue_front(rx_queue) != NULL;
 #else
     return occupied;
 #endif
-}
\ No newline at end of file
+}
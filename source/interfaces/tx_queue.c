@@ -11,6 +11,11 @@ static uint8_t bufferPtr, isSending;
 #define tx_acc_buffer sendFrame[bufferPtr]
 #endif
 
+#if JD_TX_COALESCE_US
+static uint32_t tx_acc_start;
+static bool tx_acc_urgent;
+#endif
+
 #if JD_RAW_FRAME
 uint8_t rawFrameSending;
 jd_frame_t *rawFrame;
@@ -33,14 +38,70 @@ bool jd_need_to_send(jd_frame_t *f) {
 }
 #endif
 
-static jd_queue_t send_queue;
-static uint8_t q_sending;
+#if JD_TX_PRIORITY_LANES
+#define NUM_LANES JD_TX_NUM_LANES
+static const uint16_t lane_size[NUM_LANES] = {JD_TX_LANE_CTRL_SIZE, JD_TX_LANE_EVENTS_SIZE,
+                                              JD_TX_LANE_REGS_SIZE, JD_TX_LANE_BULK_SIZE};
+static jd_tx_lane_stats_t lane_stats[NUM_LANES];
+
+// the frame goes into the lane of its most urgent packet
+static unsigned frame_lane(jd_frame_t *f) {
+    unsigned lane = JD_TX_LANE_BULK;
+    for (unsigned off = 0; off < f->size; off += (f->data[off] + 4 + 3) & ~3) {
+        jd_packet_t *pkt = (jd_packet_t *)((uint8_t *)f + off);
+        unsigned idx = pkt->service_index;
+        unsigned l;
+        if (idx == JD_SERVICE_INDEX_CRC_ACK || idx == JD_SERVICE_INDEX_CONTROL)
+            return JD_TX_LANE_CTRL;
+        else if (idx == JD_SERVICE_INDEX_STREAM)
+            l = JD_TX_LANE_BULK;
+        else if (!(f->flags & JD_FRAME_FLAG_COMMAND) && (pkt->service_command & JD_CMD_EVENT_MASK))
+            l = JD_TX_LANE_EVENTS;
+        else
+            l = JD_TX_LANE_REGS;
+        if (l < lane)
+            lane = l;
+    }
+    return lane;
+}
+
+const jd_tx_lane_stats_t *jd_tx_lane_stats(unsigned lane) {
+    JD_ASSERT(lane < NUM_LANES);
+    return &lane_stats[lane];
+}
+
+unsigned jd_tx_lane_occupancy(unsigned lane) {
+    JD_ASSERT(lane < NUM_LANES);
+    return lane_stats[lane].frames_queued - lane_stats[lane].frames_sent;
+}
+#else
+#define NUM_LANES 1
+#endif
+
+static jd_queue_t send_queue[NUM_LANES];
+static uint8_t q_sending; // 1 + lane of frame returned from jd_tx_get_frame(), or 0
 int jd_send_frame_raw(jd_frame_t *f) {
     int r = 0;
 
     if (jd_need_to_send(f)) {
         // put in sendQ first
-        r = jd_queue_push(send_queue, f);
+#if JD_TX_PRIORITY_LANES
+        unsigned lane = frame_lane(f);
+        jd_tx_lane_stats_t *st = &lane_stats[lane];
+        // count before pushing, so that occupancy never goes negative
+        st->frames_queued++;
+        r = jd_queue_push(send_queue[lane], f);
+        if (r) {
+            st->frames_queued--;
+            st->frames_dropped++;
+        } else {
+            unsigned occ = jd_tx_lane_occupancy(lane);
+            if (occ > st->max_occupancy)
+                st->max_occupancy = occ;
+        }
+#else
+        r = jd_queue_push(send_queue[0], f);
+#endif
         if (r)
             OVF_ERROR("frm send ovf");
     }
@@ -63,8 +124,20 @@ static int jd_send_frame_with_crc(jd_frame_t *f) {
     return jd_send_frame(f);
 }
 
+bool jd_tx_will_fit_frame(jd_frame_t *f) {
+#if JD_TX_PRIORITY_LANES
+    return jd_queue_will_fit(send_queue[frame_lane(f)], JD_FRAME_SIZE(f));
+#else
+    return jd_queue_will_fit(send_queue[0], JD_FRAME_SIZE(f));
+#endif
+}
+
 bool jd_tx_will_fit(unsigned size) {
-    return jd_queue_will_fit(send_queue, size);
+#if JD_TX_PRIORITY_LANES
+    return jd_queue_will_fit(send_queue[JD_TX_LANE_REGS], size);
+#else
+    return jd_queue_will_fit(send_queue[0], size);
+#endif
 }
 #endif
 
@@ -74,8 +147,11 @@ int jd_tx_is_idle(void) {
         return 0;
 #endif
 #if JD_SEND_FRAME
-    if (q_sending || jd_queue_front(send_queue))
+    if (q_sending)
         return 0;
+    for (unsigned i = 0; i < NUM_LANES; ++i)
+        if (jd_queue_front(send_queue[i]))
+            return 0;
 #else
     if (isSending)
         return 0;
@@ -89,14 +165,32 @@ int jd_tx_is_idle(void) {
 
 void jd_tx_init(void) {
 #if JD_SEND_FRAME
-    if (!send_queue)
-        send_queue = jd_queue_alloc(JD_SEND_FRAME_SIZE);
+#if JD_TX_PRIORITY_LANES
+    for (unsigned i = 0; i < NUM_LANES; ++i)
+        if (!send_queue[i])
+            send_queue[i] = jd_queue_alloc(lane_size[i]);
+#else
+    if (!send_queue[0])
+        send_queue[0] = jd_queue_alloc(JD_SEND_FRAME_SIZE);
+#endif
 #else
     if (!sendFrame)
         sendFrame = (jd_frame_t *)jd_alloc(sizeof(jd_frame_t) * 2);
 #endif
 }
 
+#if JD_TX_COALESCE_US
+static bool is_urgent(unsigned service_num, unsigned service_cmd) {
+    // CRC ACKs and the like
+    if (service_num >= JD_SERVICE_INDEX_MAX_NORMAL)
+        return true;
+    if (service_cmd & JD_CMD_EVENT_MASK)
+        return true;
+    srv_t *s = jd_service_by_index(service_num);
+    return s && (((srv_common_t *)s)->srv_flags & JD_SRV_FLAG_URGENT);
+}
+#endif
+
 int jd_send(unsigned service_num, unsigned service_cmd, const void *data, unsigned service_size) {
     if (target_in_irq())
         JD_PANIC();
@@ -106,14 +200,31 @@ int jd_send(unsigned service_num, unsigned service_cmd, const void *data, unsign
 #if JD_SEND_FRAME
         jd_send_frame_with_crc(&tx_acc_buffer);
         jd_reset_frame(&tx_acc_buffer);
+#if JD_TX_COALESCE_US
+        tx_acc_urgent = false;
+#endif
         trg = jd_push_in_frame(&tx_acc_buffer, service_num, service_cmd, service_size);
         JD_ASSERT(trg != NULL);
 #else
-        OVF_ERROR("send ovf");
-        return -1;
+#if JD_TX_COALESCE_US
+        // the frame may have been held; try to send it now
+        jd_tx_flush();
+        trg = jd_push_in_frame(&tx_acc_buffer, service_num, service_cmd, service_size);
+#endif
+        if (!trg) {
+            OVF_ERROR("send ovf");
+            return -1;
+        }
 #endif
     }
 
+#if JD_TX_COALESCE_US
+    if ((uint8_t *)trg - tx_acc_buffer.data == 4)
+        tx_acc_start = now; // first packet in frame
+    if (!tx_acc_urgent && is_urgent(service_num, service_cmd))
+        tx_acc_urgent = true;
+#endif
+
     if (service_size > 0) {
         JD_ASSERT(data != NULL);
         memcpy(trg, data, service_size);
@@ -134,10 +245,13 @@ jd_frame_t *jd_tx_get_frame(void) {
 #endif
 #if JD_SEND_FRAME
     JD_ASSERT(!q_sending);
-    jd_frame_t *f = jd_queue_front(send_queue);
-    if (f) {
-        q_sending = true;
-        return f;
+    // lanes are in priority order
+    for (unsigned i = 0; i < NUM_LANES; ++i) {
+        jd_frame_t *f = jd_queue_front(send_queue[i]);
+        if (f) {
+            q_sending = i + 1;
+            return f;
+        }
     }
 #else
     if (isSending == 1) {
@@ -154,8 +268,11 @@ static void poke_ready(void) {
         jd_packet_ready();
 #endif
 #if JD_SEND_FRAME
-    if (jd_queue_front(send_queue))
-        jd_packet_ready();
+    for (unsigned i = 0; i < NUM_LANES; ++i)
+        if (jd_queue_front(send_queue[i])) {
+            jd_packet_ready();
+            break;
+        }
 #else
     if (isSending)
         jd_packet_ready();
@@ -174,8 +291,11 @@ void jd_tx_frame_sent(jd_frame_t *pkt) {
 
 #if JD_SEND_FRAME
     JD_ASSERT(q_sending);
-    jd_queue_shift(send_queue);
-    q_sending = false;
+    jd_queue_shift(send_queue[q_sending - 1]);
+#if JD_TX_PRIORITY_LANES
+    lane_stats[q_sending - 1].frames_sent++;
+#endif
+    q_sending = 0;
 #else
     JD_ASSERT(isSending == 2);
     isSending = 0;
@@ -207,4 +327,23 @@ void jd_tx_flush(void) {
     jd_services_packet_queued();
 
     jd_reset_frame(&tx_acc_buffer);
+#if JD_TX_COALESCE_US
+    tx_acc_urgent = false;
+#endif
+}
+
+void jd_tx_process(void) {
+#if JD_TX_COALESCE_US
+    jd_frame_t *f = &tx_acc_buffer;
+    if (f->size == 0)
+        return;
+    if (!tx_acc_urgent && f->size * 100 < JD_SERIAL_PAYLOAD_SIZE * JD_TX_COALESCE_FILL) {
+        uint32_t held = now - tx_acc_start;
+        if (held < JD_TX_COALESCE_US) {
+            jd_set_max_sleep(JD_TX_COALESCE_US - held);
+            return;
+        }
+    }
+#endif
+    jd_tx_flush();
 }
@@ -0,0 +1,354 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "jd_protocol.h"
+#include "jd_pipes.h"
+
+#if JD_64 && JD_CLIENT && JD_SEND_FRAME
+
+#include <stdlib.h>
+
+// Benchmark of the in-process frame pipeline:
+//   jd_send() -> jd_tx_flush() -> jd_send_frame_raw() -> send queue + loopback ->
+//   jd_rx_get_frame() -> jd_services_process_frame() -> service handle_pkt()
+// The send queue is drained by the benchmark, as if frames went out on the wire,
+// so nothing else (jd_physical.c, USB) should be consuming it at the same time.
+// The output pipe benchmark measures throughput vs jd_opipe_set_window() size over
+// a simulated link, and checks the data that reaches a local input pipe.
+// With JD_ALLOC_STATS, jd_alloc()/jd_free() calls in each run are reported.
+//
+// Call jd_bench_init() from app_init_services(), and jd_bench_run() after jd_init().
+// The jd_bench host executable (bench/main.c, cmake -DJACDAC_BENCH=ON) does just that.
+// Under JD_SIM the clock only moves when told to, so each round then counts as
+// BENCH_SIM_ROUND_US; figures are in simulated time.
+
+#define BENCH_SERVICE_CLASS 0x1b3c5d7f // not a real service
+#define BENCH_NUM_SERVICES 4
+#define BENCH_CMD_ECHO 0x80
+#define BENCH_REG_VALUE 0x80
+#define BENCH_REPORT_STREAM JD_GET(JD_REG_READING)
+#define BENCH_MAX_SAMPLES 100000
+#define BENCH_DURATION_US 300000
+#define BENCH_SIM_ROUND_US 10
+
+struct srv_state {
+    SRV_COMMON;
+    uint32_t value;
+    uint16_t small;
+    uint8_t flag;
+};
+
+REG_DEFINITION(bench_regs,                   //
+               REG_SRV_COMMON,               //
+               REG_U32(BENCH_REG_VALUE),     //
+               REG_U16(BENCH_REG_VALUE + 1), //
+               REG_U8(BENCH_REG_VALUE + 2),  //
+)
+
+static uint8_t first_idx;
+static uint32_t lat[BENCH_MAX_SAMPLES];
+static unsigned num_lat, num_rx, num_cmds;
+
+static void bench_process(srv_t *state) {}
+
+static void bench_handle_packet(srv_t *state, jd_packet_t *pkt) {
+    num_cmds++;
+    if (pkt->service_command == BENCH_CMD_ECHO)
+        jd_send(pkt->service_index, BENCH_CMD_ECHO, pkt->data, pkt->service_size);
+    else
+        service_handle_register_final(state, pkt, bench_regs);
+}
+
+SRV_DEF(bench, BENCH_SERVICE_CLASS);
+
+void jd_bench_init(void) {
+    for (int i = 0; i < BENCH_NUM_SERVICES; ++i) {
+        SRV_ALLOC(bench);
+        if (i == 0)
+            first_idx = state->service_index;
+    }
+}
+
+static uint32_t micros(void) {
+    return (uint32_t)tim_get_micros();
+}
+
+// start of a benchmark round
+static void tick(void) {
+#if JD_SIM
+    target_wait_us(BENCH_SIM_ROUND_US);
+#endif
+    jd_refresh_now();
+}
+
+static void drain_tx(void) {
+    jd_frame_t *f;
+    while ((f = jd_tx_get_frame()) != NULL)
+        jd_tx_frame_sent(f);
+}
+
+// record latency of our reports, and run the frame through services
+static void process_rx(void) {
+    jd_frame_t *fr;
+    while ((fr = jd_rx_get_frame()) != NULL) {
+        uint32_t t = micros();
+        if (!(fr->flags & JD_FRAME_FLAG_COMMAND) && fr->device_identifier == jd_device_id()) {
+            for (unsigned off = 0; off < fr->size; off += (fr->data[off] + 4 + 3) & ~3) {
+                jd_packet_t *pkt = (jd_packet_t *)((uint8_t *)fr + off);
+                if (pkt->service_index < first_idx ||
+                    pkt->service_index >= first_idx + BENCH_NUM_SERVICES ||
+                    pkt->service_size < 4)
+                    continue;
+                num_rx++;
+                if (num_lat < BENCH_MAX_SAMPLES) {
+                    uint32_t stamp;
+                    memcpy(&stamp, pkt->data, 4);
+                    lat[num_lat++] = t - stamp;
+                }
+            }
+        }
+        jd_services_process_frame(fr);
+        jd_rx_release_frame(fr);
+    }
+}
+
+static void cmd_frame(jd_frame_t *f) {
+    f->flags = JD_FRAME_FLAG_COMMAND;
+    f->device_identifier = jd_device_id();
+    jd_compute_crc(f);
+    jd_send_frame(f);
+}
+
+// reports sent via jd_send(), one frame per round
+static void round_stream(unsigned size) {
+    unsigned n = JD_SERIAL_PAYLOAD_SIZE / ((size + 4 + 3) & ~3);
+    uint8_t data[JD_SERIAL_PAYLOAD_SIZE];
+    memset(data, 0x42, size);
+    for (unsigned i = 0; i < n; ++i) {
+        uint32_t stamp = micros();
+        memcpy(data, &stamp, 4);
+        jd_send(first_idx + (i % BENCH_NUM_SERVICES), BENCH_REPORT_STREAM, data, size);
+    }
+    jd_tx_flush();
+    drain_tx();
+    process_rx();
+}
+
+// commands to our services, echoed back as reports
+static void round_echo(unsigned size) {
+    static jd_frame_t frm;
+    uint8_t data[JD_SERIAL_PAYLOAD_SIZE];
+    memset(data, 0x42, size);
+    for (unsigned i = 0; i < 8; ++i) {
+        uint32_t stamp = micros();
+        memcpy(data, &stamp, 4);
+        jd_reset_frame(&frm);
+        void *trg = jd_push_in_frame(&frm, first_idx + (i % BENCH_NUM_SERVICES),
+                                     BENCH_CMD_ECHO, size);
+        memcpy(trg, data, size);
+        cmd_frame(&frm);
+        // services handle the command and jd_send() the echo;
+        // full echo frames are flushed by jd_send() and then drained here
+        drain_tx();
+        process_rx();
+    }
+    jd_tx_flush();
+    drain_tx();
+    process_rx(); // echoes
+}
+
+// register SET followed by GETs in the same frame; the first GET response carries the value set
+static void round_regs(unsigned size) {
+    static jd_frame_t frm;
+    for (unsigned i = 0; i < 8; ++i) {
+        unsigned idx = first_idx + (i % BENCH_NUM_SERVICES);
+        uint32_t stamp = micros();
+        jd_reset_frame(&frm);
+        memcpy(jd_push_in_frame(&frm, idx, JD_SET(BENCH_REG_VALUE), 4), &stamp, 4);
+        jd_push_in_frame(&frm, idx, JD_GET(BENCH_REG_VALUE), 0);
+        jd_push_in_frame(&frm, idx, JD_GET(BENCH_REG_VALUE + 1), 0);
+        cmd_frame(&frm);
+        drain_tx();
+        process_rx();
+    }
+    jd_tx_flush();
+    drain_tx();
+    process_rx();
+}
+
+// output pipe to a simulated remote device; frames sent to it are ACKed after BENCH_PIPE_RTT_US,
+// unless lost (BENCH_PIPE_LOSS percent); frames that are not lost are also passed to a local
+// input pipe, which checks that packets arrive in order
+#define BENCH_PIPE_DEVICE 0x1b3c5d7f00c0ffeeULL
+#define BENCH_PIPE_RTT_US 2000
+#define BENCH_PIPE_LOSS 3
+#define BENCH_PIPE_MAX_ACKS 32
+
+static jd_opipe_desc_t bench_pipe;
+static jd_opipe_slot_t bench_pipe_slots[JD_OPIPE_MAX_WINDOW];
+static jd_ipipe_desc_t bench_ipipe;
+static struct {
+    uint32_t crc;
+    uint32_t due;
+} pipe_acks[BENCH_PIPE_MAX_ACKS];
+static unsigned num_pipe_acks;
+// written by the sender, and expected next, received in order, and out of order by the receiver
+static uint32_t pipe_seq, pipe_next_seq, pipe_rx_ok, pipe_rx_bad;
+static bool pipe_eof;
+static unsigned pipe_pkt_size;
+
+static void pipe_rx(jd_ipipe_desc_t *istr, jd_packet_t *pkt) {
+    uint32_t seq;
+    memcpy(&seq, pkt->data, 4);
+    if (pkt->service_size == pipe_pkt_size && seq == pipe_next_seq)
+        pipe_rx_ok++;
+    else
+        pipe_rx_bad++;
+    pipe_next_seq = seq + 1;
+}
+
+static void pipe_rx_meta(jd_ipipe_desc_t *istr, jd_packet_t *pkt) {
+    if (pkt == NULL)
+        pipe_eof = true;
+}
+
+static void pipe_wire(void) {
+    static jd_frame_t rx;
+    jd_frame_t *f;
+    while ((f = jd_tx_get_frame()) != NULL) {
+        if (f->device_identifier == BENCH_PIPE_DEVICE && num_pipe_acks < BENCH_PIPE_MAX_ACKS &&
+            jd_random() % 100 >= BENCH_PIPE_LOSS) {
+            pipe_acks[num_pipe_acks].crc = f->crc;
+            pipe_acks[num_pipe_acks].due = micros() + BENCH_PIPE_RTT_US;
+            num_pipe_acks++;
+            memcpy(&rx, f, JD_FRAME_SIZE(f));
+            rx.device_identifier = jd_device_id();
+            for (;;) {
+                jd_ipipe_handle_packet((jd_packet_t *)&rx);
+                if (!jd_shift_frame(&rx))
+                    break;
+            }
+        }
+        jd_tx_frame_sent(f);
+    }
+
+    static jd_frame_t ack;
+    for (unsigned i = 0; i < num_pipe_acks;) {
+        if (in_past(pipe_acks[i].due)) {
+            jd_packet_t *pkt = (jd_packet_t *)&ack;
+            memset(&ack, 0, JD_SERIAL_FULL_HEADER_SIZE);
+            pkt->device_identifier = BENCH_PIPE_DEVICE;
+            pkt->service_index = JD_SERVICE_INDEX_CRC_ACK;
+            pkt->service_command = pipe_acks[i].crc;
+            jd_opipe_handle_packet(pkt);
+            pipe_acks[i] = pipe_acks[--num_pipe_acks];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void round_pipe(void) {
+    uint8_t data[JD_SERIAL_PAYLOAD_SIZE];
+    memset(data, 0x42, pipe_pkt_size);
+    for (;;) {
+        memcpy(data, &pipe_seq, 4);
+        if (jd_opipe_write(&bench_pipe, data, pipe_pkt_size) != JD_PIPE_OK)
+            break;
+        pipe_seq++;
+    }
+    jd_opipe_process();
+    pipe_wire();
+    process_rx();
+}
+
+// with 32 byte packets, JD_PIPE_MAX_IN_FLIGHT packets fill less than 3 frames,
+// so larger windows only help with larger packets
+static void run_pipe(unsigned window, unsigned pkt_size) {
+    pipe_pkt_size = pkt_size;
+    int port = jd_ipipe_open(&bench_ipipe, pipe_rx, pipe_rx_meta);
+    jd_ipipe_allow_reorder(&bench_ipipe);
+    jd_opipe_open(&bench_pipe, BENCH_PIPE_DEVICE, port);
+    if (window > 1)
+        jd_opipe_set_window(&bench_pipe, bench_pipe_slots, window);
+    num_pipe_acks = pipe_seq = pipe_next_seq = pipe_rx_ok = pipe_rx_bad = 0;
+    pipe_eof = false;
+    uint32_t t0 = micros();
+    uint32_t elapsed;
+    do {
+        tick();
+        round_pipe();
+        elapsed = micros() - t0;
+    } while (elapsed < BENCH_DURATION_US);
+    unsigned rx_bytes = pipe_rx_ok * pkt_size;
+    bool dropped = jd_opipe_check_space(&bench_pipe, 0) == JD_PIPE_TIMEOUT;
+    while (jd_opipe_close(&bench_pipe) != JD_PIPE_OK) {
+        tick();
+        jd_opipe_process();
+        pipe_wire();
+        process_rx();
+    }
+    jd_ipipe_close(&bench_ipipe);
+    bool ok = !dropped && pipe_eof && !pipe_rx_bad && pipe_rx_ok == pipe_seq;
+    (void)rx_bytes; // when DMESG() is compiled out
+    (void)ok;
+
+    DMESG("bench pipe/%u/w=%u: %u kB/s (rtt %uus, loss %u%%), %u/%u pkts in order%s",
+          pkt_size, window, (unsigned)((uint64_t)rx_bytes * 1000000 / elapsed / 1024),
+          BENCH_PIPE_RTT_US, BENCH_PIPE_LOSS, (unsigned)pipe_rx_ok, (unsigned)pipe_seq,
+          dropped ? " DROPPED" : ok ? "" : " BAD");
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void run_one(const char *name, void (*round)(unsigned), unsigned size) {
+    num_lat = num_rx = num_cmds = 0;
+#if JD_ALLOC_STATS
+    jd_alloc_stats.num_alloc = jd_alloc_stats.num_free = 0;
+#endif
+    uint32_t t0 = micros();
+    uint32_t elapsed;
+    do {
+        tick();
+        round(size);
+        elapsed = micros() - t0;
+    } while (elapsed < BENCH_DURATION_US);
+
+    qsort(lat, num_lat, sizeof(lat[0]), cmp_u32);
+
+    DMESG("bench %s/%u: %u pkts/s, %u kB/s, %u cmds/s, p50 %uus, p99 %uus", name, size,
+          (unsigned)((uint64_t)num_rx * 1000000 / elapsed),
+          (unsigned)((uint64_t)num_rx * size * 1000000 / elapsed / 1024),
+          (unsigned)((uint64_t)num_cmds * 1000000 / elapsed),
+          (unsigned)(num_lat ? lat[num_lat / 2] : 0),
+          (unsigned)(num_lat ? lat[num_lat * 99 / 100] : 0));
+#if JD_ALLOC_STATS
+    DMESG("bench %s/%u: %u jd_alloc(), %u jd_free()", name, size,
+          (unsigned)jd_alloc_stats.num_alloc, (unsigned)jd_alloc_stats.num_free);
+#endif
+}
+
+void jd_bench_run(void) {
+    // get rid of anything pending
+    jd_tx_flush();
+    drain_tx();
+    process_rx();
+
+    run_one("stream", round_stream, 4);
+    run_one("stream", round_stream, 32);
+    run_one("stream", round_stream, 232);
+    run_one("echo", round_echo, 4);
+    run_one("echo", round_echo, 64);
+    run_one("regs", round_regs, 4);
+
+    for (unsigned w = 1; w <= JD_OPIPE_MAX_WINDOW; w *= 2)
+        run_pipe(w, 32);
+    for (unsigned w = 1; w <= JD_OPIPE_MAX_WINDOW; w *= 2)
+        run_pipe(w, 232);
+    drain_tx();
+}
+
+#endif
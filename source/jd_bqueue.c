@@ -1,32 +1,60 @@
 #include "jd_protocol.h"
 
+// Byte ring buffer. One byte is always left unused, so that front == back means empty.
+//
+// As with jd_queue, the producer only ever writes `back`, and the consumer only ever writes
+// `front`. By default pushes and pops still mask IRQs, so that several producers or consumers
+// can share a queue; after jd_bqueue_set_spsc() they don't, which is fine as long as there is
+// a single producer and a single consumer (eg. UART ISR and main loop).
+//
+// jd_bqueue_peek() returns the (up to) two contiguous regions of queued data, so that
+// the consumer can eg. DMA them out directly, and jd_bqueue_consume() then drops them.
 struct jd_bqueue {
     uint16_t front;
     uint16_t back;
     uint16_t size;
-    uint16_t filled;
+    uint8_t spsc;
+    uint8_t reserved;
     uint8_t data[0];
 };
 
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+JD_FAST
+static inline void lock(jd_bqueue_t q) {
+    if (!q->spsc)
+        target_disable_irq();
+}
+
+JD_FAST
+static inline void unlock(jd_bqueue_t q) {
+    if (!q->spsc)
+        target_enable_irq();
+}
+
+JD_FAST
+static unsigned occupied(jd_bqueue_t q, unsigned front, unsigned back) {
+    if (back >= front)
+        return back - front;
+    else
+        return back + q->size - front;
+}
+
 JD_FAST
 unsigned jd_bqueue_occupied_bytes(jd_bqueue_t q) {
-    return q->filled;
+    return occupied(q, LOAD(q->front), LOAD(q->back));
 }
 
 JD_FAST
 unsigned jd_bqueue_free_bytes(jd_bqueue_t q) {
-    return q->size - q->filled - 1;
+    return q->size - jd_bqueue_occupied_bytes(q) - 1;
 }
 
 JD_FAST
 static void validate(jd_bqueue_t q) {
-    if (q->back >= q->front)
-        JD_ASSERT(q->filled == q->back - q->front);
-    else
-        JD_ASSERT(q->filled == (q->back + q->size) - q->front);
     JD_ASSERT(q->front < q->size);
     JD_ASSERT(q->back < q->size);
-    JD_ASSERT(q->filled < q->size);
 }
 
 JD_FAST
@@ -36,40 +64,40 @@ int jd_bqueue_push(jd_bqueue_t q, const void *data, unsigned len) {
 
     int ret = -1;
 
-    target_disable_irq();
+    lock(q);
     validate(q);
-    if (len <= jd_bqueue_free_bytes(q)) {
+    unsigned back = q->back;
+    if (len < q->size - occupied(q, LOAD(q->front), back)) {
         ret = 0;
-        unsigned n = q->size - q->back;
+        unsigned n = q->size - back;
         if (n > len)
             n = len;
-        memcpy(q->data + q->back, data, n);
-        q->filled += len;
+        memcpy(q->data + back, data, n);
         if (len > n) {
             len -= n;
             memcpy(q->data, (const uint8_t *)data + n, len);
-            q->back = len;
+            back = len;
         } else {
-            q->back += n;
-            if (q->back == q->size)
-                q->back = 0;
+            back += n;
+            if (back == q->size)
+                back = 0;
         }
+        STORE(q->back, back);
     }
     validate(q);
-    target_enable_irq();
+    unlock(q);
 
     return ret;
 }
 
 JD_FAST
 unsigned jd_bqueue_available_cont_data(jd_bqueue_t q) {
-    unsigned ret;
-    if (q->front <= q->back)
-        ret = q->back - q->front;
+    unsigned front = q->front;
+    unsigned back = LOAD(q->back);
+    if (front <= back)
+        return back - front;
     else
-        ret = q->size - q->front;
-    JD_ASSERT(ret <= q->filled);
-    return ret;
+        return q->size - front;
 }
 
 JD_FAST
@@ -79,13 +107,47 @@ uint8_t *jd_bqueue_cont_data_ptr(jd_bqueue_t q) {
 
 JD_FAST
 void jd_bqueue_cont_data_advance(jd_bqueue_t q, unsigned sz) {
-    q->front += sz;
-    q->filled -= sz;
-    if (q->front == q->size)
-        q->front = 0;
+    unsigned front = q->front + sz;
+    JD_ASSERT(front <= q->size);
+    if (front == q->size)
+        front = 0;
+    STORE(q->front, front);
     validate(q);
 }
 
+JD_FAST
+unsigned jd_bqueue_peek(jd_bqueue_t q, jd_bqueue_seg_t seg[2]) {
+    unsigned front = q->front;
+    unsigned back = LOAD(q->back);
+    seg[0].data = q->data + front;
+    seg[1].data = q->data;
+    if (front <= back) {
+        seg[0].len = back - front;
+        seg[1].len = 0;
+    } else {
+        seg[0].len = q->size - front;
+        seg[1].len = back;
+    }
+    return seg[0].len + seg[1].len;
+}
+
+JD_FAST
+static void consume(jd_bqueue_t q, unsigned sz) {
+    unsigned front = q->front;
+    JD_ASSERT(sz <= occupied(q, front, LOAD(q->back)));
+    front += sz;
+    if (front >= q->size)
+        front -= q->size;
+    STORE(q->front, front);
+}
+
+JD_FAST
+void jd_bqueue_consume(jd_bqueue_t q, unsigned sz) {
+    lock(q);
+    consume(q, sz);
+    unlock(q);
+}
+
 JD_FAST
 void jd_bqueue_print(jd_bqueue_t q, void (*print_fn)(char ch)) {
     // we are lenient here, since this is a function used from a crash handler
@@ -93,7 +155,7 @@ void jd_bqueue_print(jd_bqueue_t q, void (*print_fn)(char ch)) {
         return;
 
     unsigned ptr = q->front;
-    unsigned len = q->filled;
+    unsigned len = occupied(q, ptr, q->back);
 
     while (len--) {
         print_fn((char)q->data[ptr++]);
@@ -103,59 +165,70 @@ void jd_bqueue_print(jd_bqueue_t q, void (*print_fn)(char ch)) {
 }
 
 JD_FAST
-unsigned jd_bqueue_pop_at_most(jd_bqueue_t q, void *dst, unsigned maxsize) {
-    unsigned sz;
-    target_disable_irq();
-    sz = jd_bqueue_available_cont_data(q);
+static unsigned pop_at_most(jd_bqueue_t q, void *dst, unsigned maxsize) {
+    jd_bqueue_seg_t seg[2];
+    unsigned sz = jd_bqueue_peek(q, seg);
     if (sz > maxsize)
         sz = maxsize;
-    memcpy(dst, jd_bqueue_cont_data_ptr(q), sz);
-    jd_bqueue_cont_data_advance(q, sz);
-    maxsize -= sz;
-    if (maxsize > 0) {
-        unsigned n = jd_bqueue_available_cont_data(q);
-        if (n > maxsize)
-            n = maxsize;
-        memcpy((uint8_t *)dst + sz, jd_bqueue_cont_data_ptr(q), n);
-        jd_bqueue_cont_data_advance(q, n);
-        sz += n;
-    }
-    target_enable_irq();
+    unsigned n = seg[0].len;
+    if (n > sz)
+        n = sz;
+    memcpy(dst, seg[0].data, n);
+    if (sz > n)
+        memcpy((uint8_t *)dst + n, seg[1].data, sz - n);
+    consume(q, sz);
+    return sz;
+}
+
+JD_FAST
+unsigned jd_bqueue_pop_at_most(jd_bqueue_t q, void *dst, unsigned maxsize) {
+    lock(q);
+    unsigned sz = pop_at_most(q, dst, maxsize);
+    unlock(q);
     return sz;
 }
 
 JD_FAST
 int jd_bqueue_pop_atomic(jd_bqueue_t q, void *dst, unsigned size) {
     int r;
-    target_disable_irq();
-    if (q->filled >= size) {
-        unsigned rr = jd_bqueue_pop_at_most(q, dst, size);
+    lock(q);
+    if (occupied(q, q->front, LOAD(q->back)) >= size) {
+        unsigned rr = pop_at_most(q, dst, size);
         JD_ASSERT(rr == size);
         r = 0;
     } else {
         r = -1;
     }
-    target_enable_irq();
+    unlock(q);
     return r;
 }
 
 JD_FAST
 int jd_bqueue_pop_byte(jd_bqueue_t q) {
     int r;
-    target_disable_irq();
-    if (q->filled) {
-        r = *jd_bqueue_cont_data_ptr(q);
-        jd_bqueue_cont_data_advance(q, 1);
+    lock(q);
+    unsigned front = q->front;
+    if (front != LOAD(q->back)) {
+        r = q->data[front++];
+        if (front == q->size)
+            front = 0;
+        STORE(q->front, front);
     } else {
         r = -1;
     }
-    target_enable_irq();
+    unlock(q);
     return r;
 }
 
 JD_FAST
 void jd_bqueue_clear(jd_bqueue_t q) {
-    q->front = q->back = q->filled = 0;
+    target_disable_irq();
+    q->front = q->back = 0;
+    target_enable_irq();
+}
+
+void jd_bqueue_set_spsc(jd_bqueue_t q, bool spsc) {
+    q->spsc = spsc;
 }
 
 JD_FAST
@@ -167,6 +240,49 @@ jd_bqueue_t jd_bqueue_alloc(unsigned size) {
 
 #if JD_64
 #define TEST_SIZE 512
+#define BENCH_BYTES (4 * 1024 * 1024)
+#define BENCH_CHUNK 48
+
+// producer pushes BENCH_CHUNK bytes at a time until full, then the consumer drains the queue
+// byte-by-byte, with bulk copy, or in place (as eg. a DMA would)
+static void jd_bqueue_bench(jd_bqueue_t q, int mode) {
+    static uint8_t chunk[BENCH_CHUNK];
+    uint8_t buf[128];
+    unsigned num = 0, acc = 0;
+
+    jd_bqueue_clear(q);
+    uint64_t t0 = tim_get_micros();
+    while (num < BENCH_BYTES) {
+        while (jd_bqueue_push(q, chunk, BENCH_CHUNK) == 0)
+            ;
+        if (mode == 0) {
+            int c;
+            while ((c = jd_bqueue_pop_byte(q)) >= 0) {
+                acc += c;
+                num++;
+            }
+        } else if (mode == 1) {
+            unsigned n;
+            while ((n = jd_bqueue_pop_at_most(q, buf, sizeof(buf))) > 0) {
+                acc += buf[0];
+                num += n;
+            }
+        } else {
+            jd_bqueue_seg_t seg[2];
+            unsigned n = jd_bqueue_peek(q, seg);
+            acc += seg[0].data[0];
+            jd_bqueue_consume(q, n);
+            num += n;
+        }
+    }
+    uint32_t dur = tim_get_micros() - t0;
+    if (dur == 0)
+        dur = 1;
+    DMESG("bq-bench %s %s: %u MB/s (%x)", q->spsc ? "spsc" : "irq",
+          mode == 0 ? "byte" : mode == 1 ? "bulk" : "peek",
+          (unsigned)((uint64_t)num / dur), acc);
+}
+
 void jd_bqueue_test(void) {
     jd_bqueue_t q = jd_bqueue_alloc(TEST_SIZE);
     int len = 0;
@@ -193,8 +309,18 @@ void jd_bqueue_test(void) {
             }
         } else {
             int sz = (jd_random() & 0xff) + 1;
-            if ((jd_random() & 1) == 1) {
+            int mode = jd_random() & 3;
+            if (mode == 0) {
                 sz = jd_bqueue_pop_at_most(q, buf, sz);
+            } else if (mode == 1) {
+                jd_bqueue_seg_t seg[2];
+                int avail = jd_bqueue_peek(q, seg);
+                JD_ASSERT(avail == len);
+                if (sz > avail)
+                    sz = avail;
+                for (int j = 0; j < sz; ++j)
+                    buf[j] = j < (int)seg[0].len ? seg[0].data[j] : seg[1].data[j - seg[0].len];
+                jd_bqueue_consume(q, sz);
             } else {
                 if (jd_bqueue_pop_atomic(q, buf, sz) != 0) {
                     JD_ASSERT(len < sz);
@@ -209,8 +335,17 @@ void jd_bqueue_test(void) {
         }
 
         JD_ASSERT(len == (int)jd_bqueue_occupied_bytes(q));
+        if ((i & 0xfff) == 0)
+            jd_bqueue_set_spsc(q, (i >> 12) & 1);
     }
 
+    jd_bqueue_set_spsc(q, false);
+    for (int mode = 0; mode < 3; ++mode)
+        jd_bqueue_bench(q, mode);
+    jd_bqueue_set_spsc(q, true);
+    for (int mode = 0; mode < 3; ++mode)
+        jd_bqueue_bench(q, mode);
+
     DMESG("q-test OK %d full", numfull);
 }
 #endif
@@ -17,3 +17,8 @@ void jd_set_max_sleep(uint32_t us)
     if (jd_max_sleep > us)
         jd_max_sleep = us;
 }
+
+void jd_set_max_sleep_ms(uint32_t ms) {
+    // clamp, so that the conversion to us doesn't overflow
+    jd_set_max_sleep(ms > 4000000 ? 4000000000U : ms * 1000);
+}
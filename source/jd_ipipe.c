@@ -9,26 +9,50 @@
     JD_PANIC()
 #define UNLOCK() ((void)0)
 
-static jd_ipipe_desc_t *ipipes;
+#if JD_IPIPE_REORDER && JD_IPIPE_REORDER != JD_PIPE_MAX_IN_FLIGHT - 1
+#error "JD_IPIPE_REORDER has to be 0 or JD_PIPE_MAX_IN_FLIGHT - 1"
+#endif
+
+// power of 2 above JD_IPIPE_REORDER; bits in reorder_mask
+#define REORDER_SLOTS 16
+#if JD_IPIPE_REORDER >= REORDER_SLOTS
+#error "REORDER_SLOTS too small"
+#endif
+
+// hashed by port number, which is random
+static jd_ipipe_desc_t *ipipes[JD_IPIPE_BUCKETS];
+
+static inline int ipipe_port(uint16_t counter) {
+    return counter >> JD_PIPE_PORT_SHIFT;
+}
+
+static jd_ipipe_desc_t **ipipe_bucket(int port) {
+    return &ipipes[port & (JD_IPIPE_BUCKETS - 1)];
+}
 
 static void jd_ipipe_free(jd_ipipe_desc_t *str) {
-    if (ipipes == str) {
-        ipipes = str->next;
-    } else {
-        for (jd_ipipe_desc_t *ss = ipipes; ss; ss = ss->next)
-            if (ss->next == str) {
-                ss->next = str->next;
-                break;
-            }
-    }
+    if (str->counter == 0)
+        return; // not open
+    for (jd_ipipe_desc_t **p = ipipe_bucket(ipipe_port(str->counter)); *p; p = &(*p)->next)
+        if (*p == str) {
+            *p = str->next;
+            break;
+        }
     str->counter = 0;
+#if JD_IPIPE_REORDER
+    if (str->reorder) {
+        jd_free(str->reorder);
+        str->reorder = NULL;
+    }
+    str->reorder_mask = 0;
+#endif
 }
 
 static bool is_free_port(int p) {
     if (!p)
         return false;
-    for (jd_ipipe_desc_t *ss = ipipes; ss; ss = ss->next) {
-        if ((ss->counter >> JD_PIPE_PORT_SHIFT) == p)
+    for (jd_ipipe_desc_t *ss = *ipipe_bucket(p); ss; ss = ss->next) {
+        if (ipipe_port(ss->counter) == p)
             return false;
     }
     return true;
@@ -47,11 +71,74 @@ int jd_ipipe_open(jd_ipipe_desc_t *str, jd_ipipe_handler_t handler,
             break;
         }
     }
-    str->next = ipipes;
-    ipipes = str;
+#if JD_IPIPE_REORDER
+    str->reorder_allowed = false;
+    str->reorder = NULL;
+    str->reorder_mask = 0;
+#endif
+    jd_ipipe_desc_t **b = ipipe_bucket(ipipe_port(str->counter));
+    str->next = *b;
+    *b = str;
     UNLOCK();
-    return str->counter >> JD_PIPE_PORT_SHIFT;
+    return ipipe_port(str->counter);
+}
+
+void jd_ipipe_allow_reorder(jd_ipipe_desc_t *str) {
+#if JD_IPIPE_REORDER
+    str->reorder_allowed = true;
+#endif
+}
+
+// returns false if the pipe was closed
+static bool ipipe_deliver(jd_ipipe_desc_t *s, jd_packet_t *pkt) {
+    uint16_t cmd = pkt->service_command;
+    s->counter =
+        ((s->counter + 1) & JD_PIPE_COUNTER_MASK) | (s->counter & ~JD_PIPE_COUNTER_MASK);
+    if (cmd & JD_PIPE_METADATA_MASK) {
+        s->meta_handler(s, pkt);
+    } else {
+        s->handler(s, pkt);
+    }
+    if (cmd & JD_PIPE_CLOSE_MASK) {
+        s->meta_handler(s, NULL); // indicate EOF
+        jd_ipipe_free(s);
+        return false;
+    }
+    return true;
+}
+
+#if JD_IPIPE_REORDER
+static jd_packet_t *reorder_slot(jd_ipipe_desc_t *s, unsigned counter) {
+    return (jd_packet_t *)&s->reorder[counter & (REORDER_SLOTS - 1)];
+}
+
+// called after s->counter was incremented
+static void ipipe_deliver_reordered(jd_ipipe_desc_t *s) {
+    for (;;) {
+        unsigned bit = 1 << (s->counter & (REORDER_SLOTS - 1));
+        if (!(s->reorder_mask & bit))
+            break;
+        s->reorder_mask &= ~bit;
+        if (!ipipe_deliver(s, reorder_slot(s, s->counter)))
+            break;
+    }
+}
+
+static void ipipe_keep(jd_ipipe_desc_t *s, jd_packet_t *pkt) {
+    unsigned counter = pkt->service_command;
+    unsigned bit = 1 << (counter & (REORDER_SLOTS - 1));
+    if (s->reorder_mask & bit)
+        return; // re-transmitted
+    if (!s->reorder) {
+        // allocated once per pipe, packets are copied here
+        s->reorder = jd_alloc(REORDER_SLOTS * sizeof(jd_frame_t));
+        if (!s->reorder)
+            return; // dropped, as without reordering
+    }
+    memcpy(reorder_slot(s, counter), pkt, JD_SERIAL_FULL_HEADER_SIZE + pkt->service_size);
+    s->reorder_mask |= bit;
 }
+#endif
 
 void jd_ipipe_handle_packet(jd_packet_t *pkt) {
     if (pkt->service_index != JD_SERVICE_INDEX_STREAM || jd_is_report(pkt) ||
@@ -59,22 +146,24 @@ void jd_ipipe_handle_packet(jd_packet_t *pkt) {
         return;
 
     uint16_t cmd = pkt->service_command;
-    int port = cmd >> JD_PIPE_PORT_SHIFT;
-    for (jd_ipipe_desc_t *s = ipipes; s; s = s->next) {
-        if ((s->counter >> JD_PIPE_PORT_SHIFT) == port) {
-            if ((s->counter & JD_PIPE_COUNTER_MASK) == (cmd & JD_PIPE_COUNTER_MASK)) {
-                s->counter = ((s->counter + 1) & JD_PIPE_COUNTER_MASK) |
-                             (s->counter & ~JD_PIPE_COUNTER_MASK);
-                if (cmd & JD_PIPE_METADATA_MASK) {
-                    s->meta_handler(s, pkt);
-                } else {
-                    s->handler(s, pkt);
-                }
-                if (cmd & JD_PIPE_CLOSE_MASK) {
-                    s->meta_handler(s, NULL); // indicate EOF
-                    jd_ipipe_free(s);
-                }
+    int port = ipipe_port(cmd);
+    for (jd_ipipe_desc_t *s = *ipipe_bucket(port); s; s = s->next) {
+        if (ipipe_port(s->counter) == port) {
+            // senders keep at most JD_PIPE_MAX_IN_FLIGHT packets not CRC-ACKed, so packets
+            // further ahead are actually behind - re-transmissions, which are dropped
+            unsigned ahead = (cmd - s->counter) & JD_PIPE_COUNTER_MASK;
+            if (ahead == 0) {
+#if JD_IPIPE_REORDER
+                if (ipipe_deliver(s, pkt))
+                    ipipe_deliver_reordered(s);
+#else
+                ipipe_deliver(s, pkt);
+#endif
             }
+#if JD_IPIPE_REORDER
+            else if (s->reorder_allowed && ahead < JD_PIPE_MAX_IN_FLIGHT)
+                ipipe_keep(s, pkt);
+#endif
             break;
         }
     }
@@ -38,7 +38,7 @@ int jd_opipe_open(jd_opipe_desc_t *str, uint64_t device_id, uint16_t port_num) {
     if (device_id == 0)
         return JD_PIPE_ERROR;
 
-    jd_frame_t *f = &str->frame;
+    jd_frame_t *f = &str->main.frame;
 
     LOCK();
     jd_opipe_unlink(str);
@@ -46,7 +46,8 @@ int jd_opipe_open(jd_opipe_desc_t *str, uint64_t device_id, uint16_t port_num) {
     f->flags = JD_FRAME_FLAG_COMMAND | JD_FRAME_FLAG_ACK_REQUESTED;
     str->counter = port_num << JD_PIPE_PORT_SHIFT;
     str->status = ST_OPEN;
-    str->curr_retry = 0;
+    str->main.curr_retry = 0;
+    str->rto = JD_OPIPE_INITIAL_RTO_US;
     str->next = opipes;
     opipes = str;
     UNLOCK();
@@ -54,6 +55,18 @@ int jd_opipe_open(jd_opipe_desc_t *str, uint64_t device_id, uint16_t port_num) {
     return JD_PIPE_OK;
 }
 
+int jd_opipe_set_window(jd_opipe_desc_t *str, jd_opipe_slot_t *slots, unsigned num_slots) {
+    if (str->status != ST_OPEN || str->main.curr_retry || str->main.frame.size ||
+        num_slots > JD_OPIPE_MAX_WINDOW)
+        return JD_PIPE_ERROR;
+    LOCK();
+    memset(slots, 0, num_slots * sizeof(jd_opipe_slot_t));
+    str->window = num_slots ? slots : NULL;
+    str->window_size = num_slots;
+    UNLOCK();
+    return JD_PIPE_OK;
+}
+
 int jd_opipe_open_cmd(jd_opipe_desc_t *str, jd_packet_t *pkt) {
     if (pkt->service_size < sizeof(jd_pipe_cmd_t))
         return JD_PIPE_ERROR;
@@ -67,53 +80,173 @@ int jd_opipe_open_report(jd_opipe_desc_t *str, jd_packet_t *pkt) {
     return jd_opipe_open(str, pkt->device_identifier, *(uint16_t *)pkt->data);
 }
 
+// frames that can be waiting for ACK
+static jd_opipe_slot_t *opipe_slots(jd_opipe_desc_t *str, unsigned *num) {
+    if (str->window) {
+        *num = str->window_size;
+        return str->window;
+    } else {
+        *num = 1;
+        return &str->main;
+    }
+}
+
+static bool opipe_in_flight(jd_opipe_desc_t *str) {
+    unsigned num;
+    jd_opipe_slot_t *slots = opipe_slots(str, &num);
+    for (unsigned i = 0; i < num; ++i)
+        if (slots[i].curr_retry)
+            return true;
+    return false;
+}
+
+// how far the next packet is from the oldest one not CRC-ACKed yet (or in the frame being filled)
+static unsigned opipe_unacked(jd_opipe_desc_t *str) {
+    unsigned num, r = 0;
+    jd_opipe_slot_t *slots = opipe_slots(str, &num);
+    for (unsigned i = 0; i < num; ++i) {
+        unsigned d = (str->counter - slots[i].first_counter) & JD_PIPE_COUNTER_MASK;
+        if (slots[i].curr_retry && d > r)
+            r = d;
+    }
+    if (str->main.frame.size) {
+        unsigned d = (str->counter - str->main.first_counter) & JD_PIPE_COUNTER_MASK;
+        if (d > r)
+            r = d;
+    }
+    return r;
+}
+
+static jd_opipe_slot_t *opipe_free_slot(jd_opipe_desc_t *str) {
+    unsigned num;
+    jd_opipe_slot_t *slots = opipe_slots(str, &num);
+    for (unsigned i = 0; i < num; ++i)
+        if (!slots[i].curr_retry)
+            return &slots[i];
+    return NULL;
+}
+
+static void opipe_set_rto(jd_opipe_desc_t *str, uint32_t rto) {
+    if (rto < JD_OPIPE_MIN_RTO_US)
+        rto = JD_OPIPE_MIN_RTO_US;
+    if (rto > JD_OPIPE_MAX_RTO_US)
+        rto = JD_OPIPE_MAX_RTO_US;
+    str->rto = rto;
+}
+
+static void opipe_rtt_sample(jd_opipe_desc_t *str, uint32_t rtt) {
+    if (str->srtt == 0) {
+        str->srtt = rtt ? rtt : 1;
+        str->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = rtt > str->srtt ? rtt - str->srtt : str->srtt - rtt;
+        str->rttvar = (3 * str->rttvar + delta) / 4;
+        str->srtt = (7 * str->srtt + rtt) / 8;
+        if (str->srtt == 0)
+            str->srtt = 1;
+    }
+    opipe_set_rto(str, str->srtt + 4 * str->rttvar);
+}
+
 void jd_opipe_handle_packet(jd_packet_t *pkt) {
     if (pkt->service_index != JD_SERVICE_INDEX_CRC_ACK || (pkt->flags & JD_FRAME_FLAG_COMMAND))
         return;
     LOCK();
     for (jd_opipe_desc_t *str = opipes; str; str = str->next) {
-        if (str->curr_retry && pkt->service_command == str->frame.crc &&
-            str->frame.device_identifier == pkt->device_identifier) {
-            str->curr_retry = 0;
-            jd_reset_frame(&str->frame);
-            if (str->status == ST_CLOSED_WAITING) {
-                jd_opipe_unlink(str);
-            } else if (str->status == ST_CLOSED_UNSENT) {
-                jd_opipe_send_close_pkt(str);
+        if (str->main.frame.device_identifier != pkt->device_identifier)
+            continue;
+        unsigned num;
+        jd_opipe_slot_t *slots = opipe_slots(str, &num);
+        for (unsigned i = 0; i < num; ++i) {
+            jd_opipe_slot_t *sl = &slots[i];
+            if (sl->curr_retry && pkt->service_command == sl->frame.crc) {
+                // Karn's rule - if it was re-transmitted, we don't know which copy is ACKed
+                if (sl->curr_retry == 2)
+                    opipe_rtt_sample(str, now - sl->sent_time);
+                sl->curr_retry = 0;
+                if (!str->window)
+                    jd_reset_frame(&sl->frame);
+                if (str->status == ST_CLOSED_WAITING) {
+                    if (!opipe_in_flight(str))
+                        jd_opipe_unlink(str);
+                } else if (str->status == ST_CLOSED_UNSENT) {
+                    jd_opipe_send_close_pkt(str);
+                }
+                break;
             }
         }
     }
     UNLOCK();
 }
 
+// returns false if retries are exhausted
+static bool opipe_slot_process(jd_opipe_desc_t *str, jd_opipe_slot_t *sl) {
+    if (!sl->curr_retry)
+        return true;
+    if (in_past(sl->retry_time)) {
+        if (sl->curr_retry == 1) {
+            sl->rto = str->rto;
+        } else if (sl->curr_retry == 2 && str->rto <= sl->rto) {
+            // first transmission timed out - RTT is likely larger than we think; frames sent
+            // in a burst time out together, and the RTO is only backed off for the first one
+            opipe_set_rto(str, sl->rto * 2);
+        }
+        // exponential back-off; after the last transmission, this is the grace period for ACK
+        uint32_t timeout = sl->rto << (sl->curr_retry - 1);
+        if (timeout > JD_OPIPE_MAX_RTO_US)
+            timeout = JD_OPIPE_MAX_RTO_US;
+        if (sl->curr_retry < JD_OPIPE_MAX_RETRIES + 1) {
+            if (jd_send_frame(&sl->frame) == 0) {
+                if (sl->curr_retry == 1)
+                    sl->sent_time = now;
+                sl->retry_time = now + timeout;
+                sl->curr_retry++;
+            } else {
+                // in case of ovf, give the queue some time to drain
+                sl->retry_time = now + JD_OPIPE_MIN_RTO_US;
+            }
+        } else if (sl->curr_retry == JD_OPIPE_MAX_RETRIES + 1) {
+            sl->retry_time = now + timeout;
+            sl->curr_retry++;
+        } else {
+            return false;
+        }
+    }
+    jd_set_max_sleep(in_past(sl->retry_time) ? 0 : sl->retry_time - now);
+    return true;
+}
+
 void jd_opipe_process(void) {
     LOCK();
     for (jd_opipe_desc_t *str = opipes; str; str = str->next) {
-        if (str->curr_retry && in_past(str->retry_time)) {
-            if (str->curr_retry < JD_OPIPE_MAX_RETRIES + 1) {
-                if (jd_send_frame(&str->frame) == 0) {
-                    str->retry_time = now + ((4 * 1024) << str->curr_retry);
-                    str->curr_retry++;
-                } else {
-                    // in case of ovf, give it some time
-                    str->retry_time = now + (64 << 10);
-                }
-            } else if (str->curr_retry == JD_OPIPE_MAX_RETRIES + 1) {
-                str->retry_time = now + 32 * 1024; // grace period for final ACK
-                str->curr_retry++;
-            } else {
+        if (str->status == ST_DROPPED)
+            continue;
+        unsigned num;
+        jd_opipe_slot_t *slots = opipe_slots(str, &num);
+        for (unsigned i = 0; i < num; ++i) {
+            if (!opipe_slot_process(str, &slots[i])) {
                 str->status = ST_DROPPED;
+                break;
             }
         }
     }
     UNLOCK();
 }
 
+// there has to be a free slot
 static void do_flush(jd_opipe_desc_t *str) {
-    JD_ASSERT(str->curr_retry == 0);
-    jd_compute_crc(&str->frame);
-    str->curr_retry = 1;
-    str->retry_time = now;
+    jd_opipe_slot_t *sl = opipe_free_slot(str);
+    JD_ASSERT(sl != NULL);
+    if (sl != &str->main) {
+        memcpy(&sl->frame, &str->main.frame, JD_FRAME_SIZE(&str->main.frame));
+        sl->first_counter = str->main.first_counter;
+        jd_reset_frame(&str->main.frame);
+    }
+    jd_compute_crc(&sl->frame);
+    sl->curr_retry = 1;
+    sl->retry_time = now;
+    // jd_opipe_process() sends it
+    JD_WAKE_MAIN();
 }
 
 int jd_opipe_check_space(jd_opipe_desc_t *str, unsigned len) {
@@ -121,32 +254,84 @@ int jd_opipe_check_space(jd_opipe_desc_t *str, unsigned len) {
         return JD_PIPE_TIMEOUT;
     if (str->status != ST_OPEN)
         return JD_PIPE_ERROR;
-    if (str->curr_retry != 0)
+    // without window, the frame being filled is also the one in flight
+    if (!str->window && str->main.curr_retry != 0)
         return JD_PIPE_TRY_AGAIN;
 
-    if (str->frame.size + 4 + len <= JD_SERIAL_PAYLOAD_SIZE)
+    if (opipe_unacked(str) >= JD_PIPE_MAX_IN_FLIGHT) {
+        // wait for ACKs, so the receiver doesn't confuse counters; the frame being filled
+        // is only sent short if there's nothing else to wait for
+        if (str->main.frame.size && !opipe_in_flight(str))
+            do_flush(str);
+        return JD_PIPE_TRY_AGAIN;
+    }
+
+    if (str->main.frame.size + 4 + len <= JD_SERIAL_PAYLOAD_SIZE)
         return JD_PIPE_OK;
 
+    // nothing to flush (only waiting for ACKs), or no room in window
+    if (str->main.frame.size == 0 || !opipe_free_slot(str))
+        return JD_PIPE_TRY_AGAIN;
+
     do_flush(str);
+
+    if (str->window && 4 + len <= JD_SERIAL_PAYLOAD_SIZE)
+        return JD_PIPE_OK;
     return JD_PIPE_TRY_AGAIN;
 }
 
-static int jd_opipe_write_ex(jd_opipe_desc_t *str, const void *data, unsigned len, int flags) {
+int jd_opipe_reserve(jd_opipe_desc_t *str, unsigned len, void **dst) {
     int r = jd_opipe_check_space(str, len);
     if (r)
         return r;
+    // jd_push_in_frame() in commit will put the packet header in front of it
+    *dst = str->main.frame.data + str->main.frame.size + 4;
+    return JD_PIPE_OK;
+}
 
-    void *trg = jd_push_in_frame(&str->frame, JD_SERVICE_INDEX_STREAM, str->counter | flags, len);
-    JD_ASSERT(trg != NULL);
-    memcpy(trg, data, len);
+static int opipe_commit(jd_opipe_desc_t *str, unsigned len, int flags) {
+    if (str->main.frame.size == 0)
+        str->main.first_counter = str->counter & JD_PIPE_COUNTER_MASK;
+    void *trg =
+        jd_push_in_frame(&str->main.frame, JD_SERVICE_INDEX_STREAM, str->counter | flags, len);
+    if (trg == NULL)
+        return JD_PIPE_ERROR; // more than reserved
     str->counter =
         ((str->counter + 1) & JD_PIPE_COUNTER_MASK) | (str->counter & ~JD_PIPE_COUNTER_MASK);
-
     return JD_PIPE_OK;
 }
 
+int jd_opipe_commit(jd_opipe_desc_t *str, unsigned len) {
+    return opipe_commit(str, len, 0);
+}
+
+static int jd_opipe_write_ex(jd_opipe_desc_t *str, const void *data, unsigned len, int flags) {
+    void *trg;
+    int r = jd_opipe_reserve(str, len, &trg);
+    if (r)
+        return r;
+    if (len)
+        memcpy(trg, data, len);
+    return opipe_commit(str, len, flags);
+}
+
+int jd_opipe_writev(jd_opipe_desc_t *str, const jd_opipe_iovec_t *iov, unsigned iovcnt) {
+    unsigned len = 0;
+    for (unsigned i = 0; i < iovcnt; ++i)
+        len += iov[i].len;
+    uint8_t *trg;
+    int r = jd_opipe_reserve(str, len, (void **)&trg);
+    if (r)
+        return r;
+    for (unsigned i = 0; i < iovcnt; ++i) {
+        memcpy(trg, iov[i].data, iov[i].len);
+        trg += iov[i].len;
+    }
+    return opipe_commit(str, len, 0);
+}
+
 int jd_opipe_flush(jd_opipe_desc_t *str) {
-    if (str->status == ST_OPEN && str->curr_retry == 0 && str->frame.size == 0)
+    if (str->status == ST_OPEN && str->main.frame.size == 0 && !opipe_in_flight(str))
         return JD_PIPE_OK;
     return jd_opipe_check_space(str, 0x100000);
 }
@@ -161,7 +346,12 @@ int jd_opipe_write(jd_opipe_desc_t *str, const void *data, unsigned len) {
 
 static int jd_opipe_send_close_pkt(jd_opipe_desc_t *str) {
     str->status = ST_OPEN; // avoid error check in jd_opipe_check_space()
-    int r = jd_opipe_write_ex(str, NULL, 0, JD_PIPE_CLOSE_MASK | JD_PIPE_METADATA_MASK);
+    // with window, make sure the write below doesn't flush, taking the slot needed for close packet
+    if (str->window && str->main.frame.size + 4 > JD_SERIAL_PAYLOAD_SIZE && opipe_free_slot(str))
+        do_flush(str);
+    int r = opipe_free_slot(str) ? jd_opipe_write_ex(str, NULL, 0,
+                                                     JD_PIPE_CLOSE_MASK | JD_PIPE_METADATA_MASK)
+                                 : JD_PIPE_TRY_AGAIN;
     if (r == JD_PIPE_OK) {
         str->status = ST_CLOSED_WAITING;
         do_flush(str);
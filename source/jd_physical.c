@@ -14,6 +14,8 @@
 #define JD_STATUS_TX_QUEUED 0x04
 
 static jd_frame_t rxFrame;
+// either rxFrame or a slot in the RX queue (JD_RX_ZERO_COPY)
+static jd_frame_t *rx_frame = &rxFrame;
 static void set_tick_timer(uint8_t statusClear);
 static volatile uint8_t phys_status;
 
@@ -23,6 +25,25 @@ static uint8_t txPending;
 
 static jd_diagnostics_t jd_diagnostics;
 
+#if JD_RX_INCREMENTAL_CRC
+// CRC of rx_frame bytes [2, rx_crc_pos)
+static uint16_t rx_crc;
+static uint16_t rx_crc_pos;
+
+void jd_rx_progress(uint32_t numbytes) {
+    // wait for the size byte
+    if (numbytes <= 2 || !(phys_status & JD_STATUS_RX_ACTIVE))
+        return;
+    uint32_t declaredSize = JD_FRAME_SIZE(rx_frame);
+    if (numbytes > declaredSize)
+        numbytes = declaredSize;
+    if (numbytes > rx_crc_pos) {
+        rx_crc = jd_crc16_update(rx_crc, (uint8_t *)rx_frame + rx_crc_pos, numbytes - rx_crc_pos);
+        rx_crc_pos = numbytes;
+    }
+}
+#endif
+
 jd_diagnostics_t *jd_get_diagnostics(void) {
     jd_diagnostics.bus_state = 0; // TODO?
     return &jd_diagnostics;
@@ -134,12 +155,12 @@ static void setup_rx_timeout(void) {
     // In that case, we don't want to set the rx_timeout().
     if (phys_status & JD_STATUS_RX_ACTIVE) {
         uart_flush_rx();
-        uint32_t *p = (uint32_t *)&rxFrame;
+        uint32_t *p = (uint32_t *)rx_frame;
         if (p[0] == 0 && p[1] == 0) {
             rx_timeout(); // didn't get any data after lo-pulse
         } else {
             // got the size - set timeout for whole packet
-            tim_set_timer(JD_FRAME_SIZE(&rxFrame) * 12 + 60, rx_timeout);
+            tim_set_timer(JD_FRAME_SIZE(rx_frame) * 12 + 60, rx_timeout);
         }
     } else {
         set_tick_timer(0);
@@ -158,13 +179,24 @@ void jd_line_falling(void) {
         JD_PANIC();
     phys_status |= JD_STATUS_RX_ACTIVE;
 
+#if JD_RX_ZERO_COPY
+    rx_frame = jd_rx_reserve_frame();
+    if (!rx_frame)
+        rx_frame = &rxFrame; // queue full - receive anyway, for diagnostics and bridge
+#endif
+
     // 1us faster than memset() on SAMD21
-    uint32_t *p = (uint32_t *)&rxFrame;
+    uint32_t *p = (uint32_t *)rx_frame;
     p[0] = 0;
     p[1] = 0;
     p[2] = 0;
     p[3] = 0;
 
+#if JD_RX_INCREMENTAL_CRC
+    rx_crc = 0xffff;
+    rx_crc_pos = 2;
+#endif
+
     // otherwise we can enable RX in the middle of LO pulse
     if (uart_wait_high() < 0) {
         // line didn't get high in 1ms or so - bail out
@@ -174,7 +206,7 @@ void jd_line_falling(void) {
     // pulse1();
     // target_wait_us(2);
 
-    uart_start_rx(&rxFrame, sizeof(rxFrame));
+    uart_start_rx(rx_frame, sizeof(*rx_frame));
     // log_pin_set(1, 0);
 
     // 200us max delay according to spec, +50us to get the first 4 bytes of data
@@ -187,7 +219,7 @@ void jd_line_falling(void) {
 
 void jd_rx_completed(int dataLeft) {
     LOG("rx cmpl");
-    jd_frame_t *frame = &rxFrame;
+    jd_frame_t *frame = rx_frame;
 
     jd_debug_signal_read(0);
 
@@ -212,7 +244,13 @@ void jd_rx_completed(int dataLeft) {
         return;
     }
 
+#if JD_RX_INCREMENTAL_CRC
+    // only the bytes not yet reported via jd_rx_progress() are left
+    uint16_t crc =
+        jd_crc16_update(rx_crc, (uint8_t *)frame + rx_crc_pos, declaredSize - rx_crc_pos);
+#else
     uint16_t crc = jd_crc16((uint8_t *)frame + 2, declaredSize - 2);
+#endif
     if (crc != frame->crc) {
         LINE_ERROR("crc err");
         jd_diagnostics.bus_uart_error++;
@@ -2,89 +2,124 @@
 
 #define ASSERT JD_ASSERT
 
+// Frames are stored back-to-back, each rounded up to 4 bytes.
+// When a frame doesn't fit at the end of the buffer, the producer writes a wrap marker
+// (a frame header with size==0) at the old back position (if there is room for one) and stores
+// the frame at the start of the buffer.
+//
+// The producer only ever writes `back`, and the consumer only ever writes `front`, so
+// with a single producer and a single consumer no critical section is needed.
+// jd_queue_push() still masks IRQs, so that multiple producers (eg. loopback from main loop
+// and UART ISR) can share a queue; jd_queue_push_nolock() is for the sole producer
+// (or for the highest-priority one, when all others use jd_queue_push()).
+//
+// jd_queue_reserve()/jd_queue_commit() split jd_queue_push_nolock() in two, so that
+// the producer can fill the frame in place (eg. UART DMA). Nothing is visible to the consumer
+// until commit; a reservation that is never committed is simply handed out again by
+// the next reserve/push. No other push may happen while a reservation is pending, as it would
+// land in the reserved space.
 struct jd_queue {
     uint16_t front;
     uint16_t back;
     uint16_t size;
-    uint16_t curr_size;
+    uint16_t reserved;
     uint8_t data[0];
 };
 
 #define FRM_SIZE(f) ((JD_FRAME_SIZE(f) + 3) & ~3)
 
-int jd_queue_will_fit(jd_queue_t q, unsigned size) {
-    int ret;
-    target_disable_irq();
-    if (q->front <= q->back) {
-        ret = (q->back + size <= q->size || q->front > size);
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// returns offset where a frame of `size` can be written, or -1 if it doesn't fit
+static int find_space(jd_queue_t q, unsigned back, unsigned size) {
+    unsigned front = LOAD(q->front);
+    if (front <= back) {
+        if (back + size <= q->size)
+            return back;
+        else if (front > size)
+            return 0;
     } else {
-        ret = q->back + size < q->front;
+        if (back + size < front)
+            return back;
     }
-    target_enable_irq();
-    return ret;
+    return -1;
 }
 
-int jd_queue_push(jd_queue_t q, jd_frame_t *pkt) {
+int jd_queue_will_fit(jd_queue_t q, unsigned size) {
+    return find_space(q, q->back, (size + 3) & ~3) >= 0;
+}
+
+JD_FAST
+jd_frame_t *jd_queue_reserve(jd_queue_t q, unsigned size) {
+    int ptr = find_space(q, q->back, (size + 3) & ~3);
+    if (ptr < 0)
+        return NULL;
+    return (jd_frame_t *)(q->data + ptr);
+}
+
+JD_FAST
+void jd_queue_commit(jd_queue_t q, jd_frame_t *pkt) {
     if (pkt->size == 0)
         JD_PANIC();
 
-    target_disable_irq();
+    unsigned back = q->back;
+    unsigned ptr = (uint8_t *)pkt - q->data;
+    ASSERT(ptr == back || ptr == 0);
 
-    int ret = 0;
+    if (ptr != back && back < q->size)
+        ((jd_frame_t *)(q->data + back))->size = 0; // wrap marker
 
-    unsigned size = FRM_SIZE(pkt);
-    if (q->front <= q->back) {
-        if (q->back + size <= q->size)
-            q->back += size;
-        else if (q->front > size) {
-            q->curr_size = q->back;
-            q->back = size;
-        } else {
-            ret = -1;
-        }
-    } else {
-        if (q->back + size < q->front)
-            q->back += size;
-        else
-            ret = -2;
-    }
-    if (ret == 0)
-        memcpy(q->data + q->back - size, pkt, size);
+    STORE(q->back, ptr + FRM_SIZE(pkt));
 
-    ASSERT(q->front <= q->size);
     ASSERT(q->back <= q->size);
-    ASSERT(q->curr_size <= q->size);
+}
 
-    target_enable_irq();
+JD_FAST
+int jd_queue_push_nolock(jd_queue_t q, jd_frame_t *pkt) {
+    if (pkt->size == 0)
+        JD_PANIC();
 
+    unsigned size = FRM_SIZE(pkt);
+    jd_frame_t *dst = jd_queue_reserve(q, size);
+    if (!dst)
+        return -1;
+    memcpy(dst, pkt, size);
+    jd_queue_commit(q, dst);
+    return 0;
+}
+
+int jd_queue_push(jd_queue_t q, jd_frame_t *pkt) {
+    target_disable_irq();
+    int ret = jd_queue_push_nolock(q, pkt);
+    target_enable_irq();
     return ret;
 }
 
+JD_FAST
+static unsigned front_ptr(jd_queue_t q, unsigned front) {
+    if (front >= q->size || ((jd_frame_t *)(q->data + front))->size == 0)
+        return 0;
+    return front;
+}
+
 JD_FAST
 jd_frame_t *jd_queue_front(jd_queue_t q) {
-    if (q->front != q->back) {
-        if (q->front >= q->curr_size)
-            return (jd_frame_t *)(q->data);
-        else
-            return (jd_frame_t *)(q->data + q->front);
-    } else
+    unsigned front = q->front;
+    if (front != LOAD(q->back))
+        return (jd_frame_t *)(q->data + front_ptr(q, front));
+    else
         return NULL;
 }
 
 JD_FAST
 void jd_queue_shift(jd_queue_t q) {
-    target_disable_irq();
-    jd_frame_t *pkt = jd_queue_front(q);
-    ASSERT(pkt != NULL);
-    unsigned size = FRM_SIZE(pkt);
-    if (q->front >= q->curr_size) {
-        ASSERT(q->front == q->curr_size);
-        q->front = size;
-        q->curr_size = q->size;
-    } else {
-        q->front += size;
-    }
-    target_enable_irq();
+    unsigned front = q->front;
+    ASSERT(front != LOAD(q->back));
+    front = front_ptr(q, front);
+    front += FRM_SIZE((jd_frame_t *)(q->data + front));
+    ASSERT(front <= q->size);
+    STORE(q->front, front);
 }
 
 void jd_queue_clear(jd_queue_t q) {
@@ -94,14 +129,47 @@ void jd_queue_clear(jd_queue_t q) {
 }
 
 jd_queue_t jd_queue_alloc(unsigned size) {
+    size &= ~3;
     jd_queue_t q = jd_alloc(sizeof(*q) + size);
-    q->size = q->curr_size = size;
+    q->size = size;
     q->front = q->back = 0;
     return q;
 }
 
 #if JD_64
 #define TEST_SIZE 512
+#define BENCH_ITER 200000
+
+static void jd_queue_bench(jd_queue_t q, bool nolock) {
+    static jd_frame_t frm;
+    uint32_t max_lat = 0;
+    unsigned num = 0;
+
+    jd_queue_clear(q);
+    uint64_t t0 = tim_get_micros();
+    for (int i = 0; i < BENCH_ITER; ++i) {
+        uint64_t t1 = tim_get_micros();
+        for (int j = 0; j < 8; ++j) {
+            frm.size = 4 + ((i + j) & 63);
+            if ((nolock ? jd_queue_push_nolock(q, &frm) : jd_queue_push(q, &frm)) != 0)
+                break;
+            num++;
+        }
+        while (jd_queue_front(q)) {
+            jd_queue_shift(q);
+            num++;
+        }
+        uint32_t lat = tim_get_micros() - t1;
+        if (lat > max_lat)
+            max_lat = lat;
+    }
+    uint32_t dur = tim_get_micros() - t0;
+    if (dur == 0)
+        dur = 1;
+    DMESG("q-bench %s: %u ops in %uus, %u ops/ms, max batch %uus", nolock ? "nolock" : "irq",
+          num, (unsigned)dur, (unsigned)((uint64_t)num * 1000 / dur), (unsigned)max_lat);
+}
+
 void jd_queue_test(void) {
     jd_queue_t q = jd_queue_alloc(TEST_SIZE);
     int push = 0;
@@ -117,12 +185,28 @@ void jd_queue_test(void) {
                 sz = 12;
             frm.size = sz;
             DMESG("push %d %d", push, frm.size);
-            if (jd_queue_push(q, &frm) == 0) {
+            int r;
+            if (i & 8) {
+                jd_frame_t *dst = jd_queue_reserve(q, sizeof(jd_frame_t));
+                if (dst) {
+                    memset(dst, 0xff, sizeof(jd_frame_t));
+                    memcpy(dst, &frm, JD_FRAME_SIZE(&frm));
+                    jd_queue_commit(q, dst);
+                    r = 0;
+                } else {
+                    r = jd_queue_push_nolock(q, &frm);
+                }
+            } else {
+                r = (i & 4) ? jd_queue_push_nolock(q, &frm) : jd_queue_push(q, &frm);
+            }
+            if (r == 0) {
                 push++;
                 len += FRM_SIZE(&frm);
             } else {
                 DMESG("full");
-                ASSERT(len + JD_FRAME_SIZE(&frm) > TEST_SIZE - 255);
+                ASSERT(!jd_queue_will_fit(q, JD_FRAME_SIZE(&frm)));
+                // up to one frame can be wasted at the end of the buffer
+                ASSERT(len + 2 * FRM_SIZE(&frm) > TEST_SIZE - 252);
             }
         } else {
             jd_frame_t *f = jd_queue_front(q);
@@ -133,6 +217,7 @@ void jd_queue_test(void) {
                 DMESG("pop %d", f->crc);
                 ASSERT(f->crc == shift);
                 shift++;
+                len -= FRM_SIZE(f);
                 for (int j = 0; j < f->size; ++j)
                     ASSERT(f->data[j] == 0);
                 jd_queue_shift(q);
@@ -140,6 +225,9 @@ void jd_queue_test(void) {
         }
     }
 
+    jd_queue_bench(q, false);
+    jd_queue_bench(q, true);
+
     DMESG("q-test OK");
 }
 #endif
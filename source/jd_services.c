@@ -13,6 +13,8 @@
 #define IN_SERV_SLEEP 0xfe
 
 static srv_t **services;
+// service indices sorted by service class
+static uint8_t *services_by_class;
 static uint8_t num_services, reset_counter, packets_sent;
 static uint8_t curr_service_process;
 static uint32_t lastMax, nextAnnounce;
@@ -56,6 +58,181 @@ int service_handle_register_final(srv_t *state, jd_packet_t *pkt, const uint16_t
     return r;
 }
 
+typedef struct {
+    uint16_t code;
+    uint8_t tp;
+    uint8_t bitoffset;
+    uint16_t offset;
+    uint16_t size;
+} reg_desc_t;
+
+typedef struct {
+    unsigned pos;
+    uint32_t offset;
+    uint8_t bitoffset;
+} reg_walk_t;
+
+// compute location of the next register in sdesc[]; `w` has to be zeroed initially
+static bool reg_walk_next(const uint16_t sdesc[], reg_walk_t *w, reg_desc_t *r) {
+    uint16_t sd = sdesc[w->pos];
+    if (sd == JD_REG_END)
+        return false;
+    w->pos++;
+
+    int tp = sd >> 12;
+    int regsz = regSize[tp];
+
+    if (tp == _JD_REG_BYTES)
+        regsz = sdesc[w->pos++];
+
+    if (!regsz)
+        JD_PANIC();
+
+    if (tp != _JD_REG_BIT && tp != _JD_REG_BYTES) {
+        if (w->bitoffset) {
+            w->bitoffset = 0;
+            w->offset++;
+        }
+        int align = regsz < JD_PTRSIZE ? regsz - 1 : JD_PTRSIZE - 1;
+        w->offset = (w->offset + align) & ~align;
+    }
+
+    LOG("%x:%d:%d", (sd & 0xfff), w->offset, regsz);
+
+    r->code = sd & 0xfff;
+    r->tp = tp;
+    r->bitoffset = w->bitoffset;
+    r->offset = w->offset;
+    r->size = regsz;
+
+    if (tp == _JD_REG_BIT) {
+        w->bitoffset++;
+        if (w->bitoffset == 8) {
+            w->offset++;
+            w->bitoffset = 0;
+        }
+    } else {
+        w->offset += regsz;
+    }
+
+    return true;
+}
+
+#if JD_REG_DESC_CACHE
+// sdesc[] flattened into entries sorted by register code
+typedef struct reg_table {
+    const uint16_t *sdesc;
+    uint16_t num_regs;
+    uint16_t size; // of the whole table, including header
+    reg_desc_t regs[0];
+} reg_table_t;
+
+// REG_DEFINITION() arrays are only seen once services pass them to service_handle_register(),
+// so tables are built on first use, but in space reserved by jd_services_init();
+// when that runs out, lookups walk the definition instead.
+// Each service remembers the tables it uses (eg. sensor_regs and its own).
+#define REG_SLOTS 2
+static uint8_t *reg_arena;
+static unsigned reg_arena_used;
+static reg_table_t **reg_slots; // REG_SLOTS per service
+
+static void reg_cache_init(void) {
+    reg_arena = jd_alloc(JD_REG_DESC_CACHE);
+    reg_arena_used = 0;
+    reg_slots = jd_alloc(num_services * REG_SLOTS * sizeof(reg_table_t *));
+}
+
+static void reg_cache_deinit(void) {
+    jd_free(reg_arena);
+    jd_free(reg_slots);
+    reg_arena = NULL;
+    reg_slots = NULL;
+}
+
+static reg_table_t *reg_table_build(const uint16_t sdesc[]) {
+    for (unsigned off = 0; off < reg_arena_used;) {
+        reg_table_t *t = (reg_table_t *)(reg_arena + off);
+        if (t->sdesc == sdesc)
+            return t; // shared with another service
+        off += t->size;
+    }
+
+    reg_walk_t w = {0};
+    reg_desc_t r;
+    unsigned n = 0;
+    while (reg_walk_next(sdesc, &w, &r))
+        if (r.code < 0xf00)
+            n++;
+
+    unsigned size = sizeof(reg_table_t) + n * sizeof(reg_desc_t);
+    size = (size + JD_PTRSIZE - 1) & ~(JD_PTRSIZE - 1);
+    if (reg_arena_used + size > JD_REG_DESC_CACHE)
+        return NULL;
+    reg_table_t *t = (reg_table_t *)(reg_arena + reg_arena_used);
+    reg_arena_used += size;
+    t->sdesc = sdesc;
+    t->size = size;
+    t->num_regs = 0;
+
+    memset(&w, 0, sizeof(w));
+    while (reg_walk_next(sdesc, &w, &r)) {
+        if (r.code >= 0xf00) // reserved/padding
+            continue;
+        // insertion sort - stable, so that the first definition wins, as in the linear search
+        unsigned j = t->num_regs++;
+        while (j > 0 && t->regs[j - 1].code > r.code) {
+            t->regs[j] = t->regs[j - 1];
+            j--;
+        }
+        t->regs[j] = r;
+    }
+
+    return t;
+}
+
+static reg_table_t *reg_table_get(srv_t *state, const uint16_t sdesc[]) {
+    if (!reg_slots || state->service_index >= num_services)
+        return NULL;
+    reg_table_t **slots = reg_slots + state->service_index * REG_SLOTS;
+    for (unsigned i = 0; i < REG_SLOTS; ++i)
+        if (slots[i] && slots[i]->sdesc == sdesc)
+            return slots[i];
+    reg_table_t *t = reg_table_build(sdesc);
+    for (unsigned i = 0; i < REG_SLOTS; ++i)
+        if (!slots[i]) {
+            slots[i] = t;
+            break;
+        }
+    return t;
+}
+#endif
+
+static bool reg_lookup(srv_t *state, const uint16_t sdesc[], int reg, reg_desc_t *dst) {
+#if JD_REG_DESC_CACHE
+    reg_table_t *t = reg_table_get(state, sdesc);
+    if (t) {
+        unsigned l = 0, r = t->num_regs;
+        while (l < r) {
+            unsigned m = (l + r) >> 1;
+            if (t->regs[m].code < reg)
+                l = m + 1;
+            else
+                r = m;
+        }
+        if (l < t->num_regs && t->regs[l].code == reg) {
+            *dst = t->regs[l];
+            return true;
+        }
+        return false;
+    }
+#endif
+    reg_walk_t w = {0};
+    while (reg_walk_next(sdesc, &w, dst))
+        if (dst->code == reg)
+            return true;
+    return false;
+}
+
 int service_handle_register(srv_t *state, jd_packet_t *pkt, const uint16_t sdesc[]) {
     uint16_t cmd = pkt->service_command;
     bool is_get = JD_IS_GET(cmd);
@@ -74,79 +251,45 @@ int service_handle_register(srv_t *state, jd_packet_t *pkt, const uint16_t sdesc
     if (is_set && (reg & 0xf00) == 0x100)
         return 0; // these are read-only
 
-    uint32_t offset = 0;
-    uint8_t bitoffset = 0;
-
     LOG("handle %x", reg);
 
-    for (int i = 0; sdesc[i] != JD_REG_END; ++i) {
-        uint16_t sd = sdesc[i];
-        int tp = sd >> 12;
-        int regsz = regSize[tp];
-
-        if (tp == _JD_REG_BYTES)
-            regsz = sdesc[++i];
-
-        if (!regsz)
-            JD_PANIC();
-
-        if (tp != _JD_REG_BIT && tp != _JD_REG_BYTES) {
-            if (bitoffset) {
-                bitoffset = 0;
-                offset++;
-            }
-            int align = regsz < JD_PTRSIZE ? regsz - 1 : JD_PTRSIZE - 1;
-            offset = (offset + align) & ~align;
-        }
+    reg_desc_t r;
+    if (!reg_lookup(state, sdesc, reg, &r))
+        return 0;
 
-        LOG("%x:%d:%d", (sd & 0xfff), offset, regsz);
-
-        if ((sd & 0xfff) == reg) {
-            uint8_t *sptr = (uint8_t *)state + offset;
-            if (is_get) {
-                if (tp == _JD_REG_BIT) {
-                    uint8_t v = *sptr & (1 << bitoffset) ? 1 : 0;
-                    jd_send(pkt->service_index, pkt->service_command, &v, 1);
-                } else {
-                    if (REG_IS_OPT(tp) && is_zero(sptr, regsz))
-                        return 0;
-                    jd_send(pkt->service_index, pkt->service_command, sptr, regsz);
-                }
-                return -reg;
-            } else {
-                if (tp == _JD_REG_BIT) {
-                    LOG("bit @%d - %x", offset, reg);
-                    if (pkt->data[0])
-                        *sptr |= 1 << bitoffset;
-                    else
-                        *sptr &= ~(1 << bitoffset);
-                } else if (regsz <= pkt->service_size) {
-                    LOG("exact @%d - %x", offset, reg);
-                    memcpy(sptr, pkt->data, regsz);
-                } else {
-                    LOG("too little @%d - %x", offset, reg);
-                    memcpy(sptr, pkt->data, pkt->service_size);
-                    int fill = !REG_IS_SIGNED(tp)                          ? 0
-                               : (pkt->data[pkt->service_size - 1] & 0x80) ? 0xff
-                                                                           : 0;
-                    memset(sptr + pkt->service_size, fill, regsz - pkt->service_size);
-                }
-                return reg;
-            }
+    int tp = r.tp;
+    int regsz = r.size;
+    uint8_t *sptr = (uint8_t *)state + r.offset;
+    if (is_get) {
+        if (tp == _JD_REG_BIT) {
+            uint8_t v = *sptr & (1 << r.bitoffset) ? 1 : 0;
+            jd_send(pkt->service_index, pkt->service_command, &v, 1);
+        } else {
+            if (REG_IS_OPT(tp) && is_zero(sptr, regsz))
+                return 0;
+            jd_send(pkt->service_index, pkt->service_command, sptr, regsz);
         }
-
+        return -reg;
+    } else {
         if (tp == _JD_REG_BIT) {
-            bitoffset++;
-            if (bitoffset == 8) {
-                offset++;
-                bitoffset = 0;
-            }
+            LOG("bit @%d - %x", r.offset, reg);
+            if (pkt->data[0])
+                *sptr |= 1 << r.bitoffset;
+            else
+                *sptr &= ~(1 << r.bitoffset);
+        } else if (regsz <= pkt->service_size) {
+            LOG("exact @%d - %x", r.offset, reg);
+            memcpy(sptr, pkt->data, regsz);
         } else {
-            offset += regsz;
+            LOG("too little @%d - %x", r.offset, reg);
+            memcpy(sptr, pkt->data, pkt->service_size);
+            int fill = !REG_IS_SIGNED(tp)                          ? 0
+                       : (pkt->data[pkt->service_size - 1] & 0x80) ? 0xff
+                                                                   : 0;
+            memset(sptr + pkt->service_size, fill, regsz - pkt->service_size);
         }
+        return reg;
     }
-
-    return 0;
 }
 
 void jd_services_process_frame(jd_frame_t *frame) {
@@ -184,10 +327,20 @@ srv_t *jd_allocate_service(const srv_vt_t *vt) {
     return r;
 }
 
+srv_t *jd_service_by_index(unsigned service_index) {
+    if (service_index >= num_services)
+        return NULL;
+    return services[service_index];
+}
+
 uint8_t _jd_services_curr_idx(void) {
     return num_services;
 }
 
+static uint32_t service_class_key(void *ctx, unsigned idx) {
+    return services[idx]->vt->service_class;
+}
+
 void jd_services_init(void) {
     num_services = 0;
     srv_t *tmp[JD_MAX_SERVICES];
@@ -208,6 +361,11 @@ void jd_services_init(void) {
     curr_service_process = 0;
     services = jd_alloc(sizeof(void *) * num_services);
     memcpy(services, tmp, sizeof(void *) * num_services);
+    services_by_class = jd_alloc(num_services);
+    jd_index_sort(services_by_class, num_services, service_class_key, NULL);
+#if JD_REG_DESC_CACHE
+    reg_cache_init();
+#endif
 
     // don't flash red initially - pretend we just heard from brain
     lastMax = tim_get_micros();
@@ -217,8 +375,13 @@ void jd_services_deinit(void) {
     for (int i = 0; i < num_services; ++i)
         jd_free(services[i]);
     jd_free(services);
+    jd_free(services_by_class);
+#if JD_REG_DESC_CACHE
+    reg_cache_deinit();
+#endif
     num_services = 0;
     services = NULL;
+    services_by_class = NULL;
 }
 
 void jd_services_packet_queued(void) {
@@ -338,12 +501,15 @@ void jd_services_handle_packet(jd_packet_t *pkt) {
         }
     } else if (pkt->flags & JD_FRAME_FLAG_IDENTIFIER_IS_SERVICE_CLASS) {
         uint32_t id = (uint32_t)pkt->device_identifier; // match lower 32-bits
-        for (int i = 0; i < num_services; ++i) {
+        for (unsigned p = jd_index_lower_bound(services_by_class, num_services, id,
+                                               service_class_key, NULL);
+             p < num_services; ++p) {
+            int i = services_by_class[p];
             srv_t *s = services[i];
-            if (id == s->vt->service_class) {
-                pkt->service_index = i;
-                s->vt->handle_pkt(s, pkt);
-            }
+            if (id != s->vt->service_class)
+                break;
+            pkt->service_index = i;
+            s->vt->handle_pkt(s, pkt);
         }
     }
 }
@@ -398,7 +564,7 @@ void jd_services_tick(void) {
     jd_wifi_process();
 #endif
 
-    jd_tx_flush();
+    jd_tx_process();
 }
 
 static void jd_process_everything_core(void) {
@@ -413,6 +579,10 @@ static void jd_process_everything_core(void) {
 
         jd_services_tick();
         app_process();
+#if JD_CLIENT
+        // commands queued by app_process()
+        jd_client_flush_cmds();
+#endif
 
         // if no frame was received, stop
         if (fr == NULL)
@@ -448,7 +618,7 @@ void jd_refresh_now(void) {
 }
 
 void jd_process_everything(void) {
-    jd_max_sleep = JD_MIN_MAX_SLEEP;
+    jd_max_sleep = JD_IDLE_MAX_SLEEP;
     jd_refresh_now();
     jd_process_everything_core();
 }
@@ -0,0 +1,469 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#include "jd_sim.h"
+
+#if JD_SIM
+
+// node 0 is the local node (running jd_physical.c), 1..num_peers are modelled peers
+#define LOCAL 0
+#define MAX_NODES (JD_SIM_MAX_PEERS + 1)
+#define PEER_QUEUE_SIZE 8
+
+#define EV_TX_END 1
+#define EV_PEER_GEN 2
+#define EV_PEER_TX 3
+
+typedef struct {
+    uint64_t time;
+    uint32_t seq;
+    uint8_t type;
+    uint8_t node;
+} sim_event_t;
+
+typedef struct {
+    uint64_t start;
+    uint8_t active;
+    uint8_t collided;
+    uint16_t size;
+    jd_frame_t frame;
+} sim_tx_t;
+
+typedef struct {
+    uint64_t gen_time[PEER_QUEUE_SIZE];
+    uint8_t q_front;
+    uint8_t q_len;
+    uint8_t frame_counter;
+} sim_peer_t;
+
+static jd_sim_config_t cfg;
+static jd_sim_stats_t stats;
+static uint64_t sim_now, sim_start, busy_start;
+static uint32_t sim_seed, ev_seq;
+
+// binary heap, ordered by (time, seq); there is at most one event of each type per node
+// (re-scheduling EV_PEER_TX removes the pending one)
+static sim_event_t events[MAX_NODES * 3];
+static unsigned num_events;
+
+static sim_tx_t txs[MAX_NODES];
+static sim_peer_t peers[MAX_NODES];
+static uint8_t num_active_tx;
+
+// tim_set_timer() - kept outside of the heap, since it's re-armed all the time
+static cb_t timer_cb;
+static uint64_t timer_at;
+static uint32_t timer_seq;
+
+static uint8_t irq_disabled, in_irq;
+
+// local UART receiver
+static int rx_node = -1;
+static uint8_t *rx_buf;
+static uint32_t rx_size, rx_copied;
+
+static uint32_t sim_random(void) {
+    uint32_t x = sim_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim_seed = x;
+    return x;
+}
+
+// same distribution as jd_random_around()
+static uint32_t sim_random_around(uint32_t v) {
+    uint32_t mask = 0xfffffff;
+    while (mask > v)
+        mask >>= 1;
+    return (v - (mask >> 1)) + (sim_random() & mask);
+}
+
+static bool ev_before(const sim_event_t *a, const sim_event_t *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void ev_sift_up(unsigned i, sim_event_t ev) {
+    while (i > 0) {
+        unsigned p = (i - 1) >> 1;
+        if (!ev_before(&ev, &events[p]))
+            break;
+        events[i] = events[p];
+        i = p;
+    }
+    events[i] = ev;
+}
+
+static void ev_push(uint64_t time, uint8_t type, uint8_t node) {
+    JD_ASSERT(num_events < sizeof(events) / sizeof(events[0]));
+    sim_event_t ev = {.time = time, .seq = ev_seq++, .type = type, .node = node};
+    ev_sift_up(num_events++, ev);
+}
+
+// remove event at index i
+static void ev_remove(unsigned i) {
+    sim_event_t last = events[--num_events];
+    if (i == num_events)
+        return;
+    if (i > 0 && ev_before(&last, &events[(i - 1) >> 1])) {
+        ev_sift_up(i, last);
+        return;
+    }
+    for (;;) {
+        unsigned c = 2 * i + 1;
+        if (c >= num_events)
+            break;
+        if (c + 1 < num_events && ev_before(&events[c + 1], &events[c]))
+            c++;
+        if (!ev_before(&events[c], &last))
+            break;
+        events[i] = events[c];
+        i = c;
+    }
+    events[i] = last;
+}
+
+static void ev_pop(void) {
+    ev_remove(0);
+}
+
+static void irq_call(cb_t cb) {
+    uint8_t prev = in_irq;
+    in_irq = 1;
+    cb();
+    in_irq = prev;
+}
+
+// the line is low, and it has been low long enough for everyone to notice
+static bool line_busy(void) {
+    return num_active_tx && sim_now - busy_start >= JD_SIM_SENSE_US;
+}
+
+static void rx_copy(uint32_t numbytes) {
+    sim_tx_t *tx = &txs[rx_node];
+    if (numbytes > tx->size)
+        numbytes = tx->size;
+    if (numbytes > rx_size)
+        numbytes = rx_size;
+    if (numbytes > rx_copied) {
+        memcpy(rx_buf + rx_copied, (uint8_t *)&tx->frame + rx_copied, numbytes - rx_copied);
+        rx_copied = numbytes;
+    }
+}
+
+static void schedule_peer_tx(unsigned node) {
+    for (unsigned i = 0; i < num_events; ++i)
+        if (events[i].type == EV_PEER_TX && events[i].node == node) {
+            ev_remove(i);
+            break;
+        }
+    ev_push(sim_now + sim_random_around(150), EV_PEER_TX, node);
+}
+
+static void bus_start_tx(unsigned node, const void *data, unsigned size) {
+    sim_tx_t *tx = &txs[node];
+    JD_ASSERT(!tx->active);
+
+    if (num_active_tx == 0) {
+        busy_start = sim_now;
+    } else {
+        // someone pulled the line low a moment ago, and we didn't notice
+        for (unsigned i = 0; i <= cfg.num_peers; ++i)
+            if (txs[i].active)
+                txs[i].collided = 1;
+    }
+
+    if ((const void *)&tx->frame != data)
+        memcpy(&tx->frame, data, size);
+    tx->active = 1;
+    tx->collided = num_active_tx ? 1 : 0;
+    tx->start = sim_now;
+    tx->size = size;
+    num_active_tx++;
+    stats.frames_started++;
+
+    ev_push(sim_now + JD_SIM_LO_PULSE_US + JD_SIM_DATA_GAP_US + size * JD_SIM_BYTE_US, EV_TX_END,
+            node);
+
+    // the local node sees the falling edge, unless it's transmitting or already receiving
+    if (node != LOCAL && rx_node < 0 && !txs[LOCAL].active) {
+        rx_node = node;
+        irq_call(jd_line_falling);
+    }
+}
+
+static void peer_try_tx(unsigned node) {
+    sim_peer_t *p = &peers[node];
+    // if the line is busy, we'll re-try once it goes idle
+    if (!p->q_len || txs[node].active || line_busy())
+        return;
+
+    jd_frame_t *f = &txs[node].frame;
+    memset(f, 0, JD_SERIAL_FULL_HEADER_SIZE);
+    f->device_identifier = 0x5100000000000000ULL | node;
+    uint8_t *data = jd_push_in_frame(f, 1, JD_GET(JD_REG_READING), cfg.peer_payload_size);
+    memset(data, p->frame_counter++, cfg.peer_payload_size);
+    jd_compute_crc(f);
+
+    bus_start_tx(node, f, JD_FRAME_SIZE(f));
+}
+
+static void peer_tx_done(unsigned node, sim_tx_t *tx) {
+    sim_peer_t *p = &peers[node];
+    JD_ASSERT(p->q_len > 0);
+    uint64_t t0 = p->gen_time[p->q_front];
+    p->q_front = (p->q_front + 1) % PEER_QUEUE_SIZE;
+    p->q_len--;
+    if (!tx->collided) {
+        // there is no retransmission on the physical layer - a collided frame is lost
+        uint32_t lat = sim_now - t0;
+        stats.peer_sent++;
+        stats.peer_latency_sum += lat;
+        if (lat > stats.peer_latency_max)
+            stats.peer_latency_max = lat;
+    }
+}
+
+static void peer_generate(unsigned node) {
+    sim_peer_t *p = &peers[node];
+    stats.peer_generated++;
+    if (p->q_len == PEER_QUEUE_SIZE) {
+        stats.peer_dropped++;
+    } else {
+        p->gen_time[(p->q_front + p->q_len) % PEER_QUEUE_SIZE] = sim_now;
+        if (p->q_len++ == 0 && !num_active_tx)
+            schedule_peer_tx(node);
+    }
+    ev_push(sim_now + sim_random_around(cfg.peer_interval_us), EV_PEER_GEN, node);
+}
+
+static void tx_end(unsigned node) {
+    sim_tx_t *tx = &txs[node];
+    tx->active = 0;
+    num_active_tx--;
+    if (num_active_tx == 0)
+        stats.bus_busy_us += sim_now - busy_start;
+    if (tx->collided)
+        stats.frames_collided++;
+
+    if (node == LOCAL) {
+        if (tx->collided)
+            stats.local_tx_collided++;
+        uint8_t prev = in_irq;
+        in_irq = 1;
+        // the frame was garbled on the wire; report it, as a UART driver would
+        jd_tx_completed(tx->collided ? -1 : 0);
+        in_irq = prev;
+    } else {
+        peer_tx_done(node, tx);
+        if (rx_node == (int)node) {
+            int left;
+            uint8_t prev = in_irq;
+            in_irq = 1;
+            if (tx->collided) {
+                left = -1; // framing error
+            } else {
+#if JD_RX_INCREMENTAL_CRC
+                // report data in FIFO-sized chunks, like a UART driver would
+                for (uint32_t n = JD_SIM_RX_CHUNK; n < tx->size; n += JD_SIM_RX_CHUNK) {
+                    rx_copy(n);
+                    jd_rx_progress(rx_copied);
+                }
+#endif
+                rx_copy(tx->size);
+                left = rx_size - rx_copied;
+                stats.local_rx_delivered++;
+            }
+            rx_node = -1;
+            rx_buf = NULL;
+            jd_rx_completed(left);
+            in_irq = prev;
+        }
+    }
+
+    if (num_active_tx == 0) {
+        // everyone waiting for the line to go idle now backs off, and then tries again
+        for (unsigned i = 1; i <= cfg.num_peers; ++i)
+            if (peers[i].q_len)
+                schedule_peer_tx(i);
+    }
+}
+
+void jd_sim_init(const jd_sim_config_t *config) {
+    cfg = *config;
+    if (cfg.num_peers > JD_SIM_MAX_PEERS)
+        cfg.num_peers = JD_SIM_MAX_PEERS;
+    if (cfg.peer_payload_size > JD_SERIAL_PAYLOAD_SIZE - 4)
+        cfg.peer_payload_size = JD_SERIAL_PAYLOAD_SIZE - 4;
+    if (cfg.peer_interval_us < 1)
+        cfg.peer_interval_us = 1;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(txs, 0, sizeof(txs));
+    memset(peers, 0, sizeof(peers));
+    num_events = 0;
+    num_active_tx = 0;
+    timer_cb = NULL;
+    rx_node = -1;
+    rx_buf = NULL;
+    sim_now = sim_start = 0;
+    ev_seq = 0;
+    sim_seed = cfg.seed ? cfg.seed : 1;
+    jd_seed_random(cfg.seed);
+
+    for (unsigned i = 1; i <= cfg.num_peers; ++i)
+        ev_push(sim_random() % cfg.peer_interval_us, EV_PEER_GEN, i);
+}
+
+void jd_sim_run_until(uint64_t until) {
+    JD_ASSERT(irq_disabled == 0);
+
+    for (;;) {
+        bool use_timer = timer_cb && (num_events == 0 || timer_at < events[0].time ||
+                                      (timer_at == events[0].time && timer_seq < events[0].seq));
+        uint64_t t;
+        if (use_timer)
+            t = timer_at;
+        else if (num_events)
+            t = events[0].time;
+        else
+            break;
+        if (t > until)
+            break;
+        // target_wait_us() may have moved the clock past the event
+        if (t > sim_now)
+            sim_now = t;
+
+        if (use_timer) {
+            cb_t cb = timer_cb;
+            timer_cb = NULL;
+            irq_call(cb);
+            continue;
+        }
+
+        sim_event_t ev = events[0];
+        ev_pop();
+        switch (ev.type) {
+        case EV_TX_END:
+            tx_end(ev.node);
+            break;
+        case EV_PEER_GEN:
+            peer_generate(ev.node);
+            break;
+        case EV_PEER_TX:
+            peer_try_tx(ev.node);
+            break;
+        default:
+            JD_PANIC();
+        }
+    }
+
+    if (sim_now < until)
+        sim_now = until;
+}
+
+void jd_sim_run(uint32_t duration_us, uint32_t main_period_us) {
+    uint64_t end = sim_now + duration_us;
+    while (sim_now < end) {
+        uint64_t t = sim_now + main_period_us;
+        jd_sim_run_until(t < end ? t : end);
+        jd_process_everything();
+    }
+}
+
+const jd_sim_stats_t *jd_sim_get_stats(void) {
+    stats.elapsed_us = sim_now - sim_start;
+    return &stats;
+}
+
+void jd_sim_print_stats(void) {
+    const jd_sim_stats_t *s = jd_sim_get_stats();
+    jd_diagnostics_t *d = jd_get_diagnostics();
+    unsigned elapsed_ms = (unsigned)(s->elapsed_us / 1000);
+    DMESG("sim: %u peers, %u ms, bus busy %u.%u%%", cfg.num_peers, elapsed_ms,
+          (unsigned)(s->bus_busy_us * 100 / (s->elapsed_us + 1)),
+          (unsigned)(s->bus_busy_us * 1000 / (s->elapsed_us + 1) % 10));
+    DMESG("sim: frames %u, collided %u", (unsigned)s->frames_started,
+          (unsigned)s->frames_collided);
+    DMESG("sim: peers gen %u sent %u drop %u; lat avg %u max %u us", (unsigned)s->peer_generated,
+          (unsigned)s->peer_sent, (unsigned)s->peer_dropped,
+          (unsigned)(s->peer_sent ? s->peer_latency_sum / s->peer_sent : 0), (unsigned)s->peer_latency_max);
+    DMESG("sim: local tx %u collided %u busy %u; rx %u", (unsigned)s->local_tx,
+          (unsigned)s->local_tx_collided, (unsigned)s->local_tx_busy,
+          (unsigned)s->local_rx_delivered);
+    DMESG("sim: diag lo %u uart %u timeout %u rx %u drop %u", (unsigned)d->bus_lo_error,
+          (unsigned)d->bus_uart_error, (unsigned)d->bus_timeout_error,
+          (unsigned)d->packets_received, (unsigned)d->packets_dropped);
+}
+
+//
+// interfaces/jd_hw.h
+//
+
+uint64_t tim_get_micros(void) {
+    return sim_now;
+}
+
+void tim_init(void) {}
+
+void tim_set_timer(int delta, cb_t cb) {
+    if (delta < 0)
+        delta = 0;
+    timer_at = sim_now + delta;
+    timer_seq = ev_seq++;
+    timer_cb = cb;
+}
+
+void target_disable_irq(void) {
+    irq_disabled++;
+}
+
+void target_enable_irq(void) {
+    JD_ASSERT(irq_disabled > 0);
+    irq_disabled--;
+}
+
+int target_in_irq(void) {
+    return in_irq;
+}
+
+void target_wait_us(uint32_t n) {
+    sim_now += n;
+}
+
+void uart_init_(void) {}
+
+int uart_start_tx(const void *data, uint32_t numbytes) {
+    if (line_busy()) {
+        stats.local_tx_busy++;
+        return -1;
+    }
+    stats.local_tx++;
+    bus_start_tx(LOCAL, data, numbytes);
+    return 0;
+}
+
+void uart_start_rx(void *data, uint32_t maxbytes) {
+    rx_buf = data;
+    rx_size = maxbytes;
+    rx_copied = 0;
+}
+
+void uart_disable(void) {
+    rx_node = -1;
+    rx_buf = NULL;
+}
+
+int uart_wait_high(void) {
+    return 0;
+}
+
+void uart_flush_rx(void) {
+    if (rx_node < 0 || !rx_buf)
+        return;
+    uint64_t data_start = txs[rx_node].start + JD_SIM_LO_PULSE_US + JD_SIM_DATA_GAP_US;
+    if (sim_now > data_start)
+        rx_copy((sim_now - data_start) / JD_SIM_BYTE_US);
+}
+
+#endif
@@ -7,6 +7,10 @@
 
 static uint32_t seed;
 
+#if JD_ALLOC_STATS
+jd_alloc_stats_t jd_alloc_stats;
+#endif
+
 // https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
 uint32_t jd_hash_fnv1a(const void *data, unsigned len) {
     const uint8_t *d = (const uint8_t *)data;
@@ -51,19 +55,6 @@ uint32_t jd_random_around(uint32_t v) {
     return (v - (mask >> 1)) + (jd_random() & mask);
 }
 
-// https://wiki.nicksoft.info/mcu:pic16:crc-16:home
-uint16_t jd_crc16(const void *data0, uint32_t size) {
-    const uint8_t *ptr = (const uint8_t *)data0;
-    uint16_t crc = 0xffff;
-    while (size--) {
-        uint8_t data = *ptr++;
-        uint8_t x = (crc >> 8) ^ data;
-        x ^= x >> 4;
-        crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
-    }
-    return crc;
-}
-
 bool jd_frame_crc_ok(jd_frame_t *frame) {
     return jd_crc16((uint8_t *)frame + 2, JD_FRAME_SIZE(frame) - 2) == frame->crc;
 }
@@ -137,10 +128,26 @@ void *jd_push_in_frame(jd_frame_t *frame, unsigned service_num, unsigned service
     return dst;
 }
 
+// let the main loop sleep until the sample is due (but not longer);
+// only threaded builds sleep past JD_MIN_MAX_SLEEP, MCU main loops keep their usual cadence
+static void sleep_until(uint32_t sample) {
+#if JD_THR_ANY
+    jd_set_max_sleep(in_future(sample) ? sample - now : 0);
+#endif
+}
+
 #if JD_MS_TIMER
+static void sleep_until_ms(uint32_t sample) {
+#if JD_THR_ANY
+    jd_set_max_sleep_ms(in_future_ms(sample) ? sample - now_ms : 0);
+#endif
+}
+
 bool jd_should_sample_ms(uint32_t *sample, uint32_t period) {
-    if (in_future_ms(*sample))
+    if (in_future_ms(*sample)) {
+        sleep_until_ms(*sample);
         return false;
+    }
 
     *sample += period;
 
@@ -148,13 +155,16 @@ bool jd_should_sample_ms(uint32_t *sample, uint32_t period) {
         // we lost some samples
         *sample = now_ms + period;
 
+    sleep_until_ms(*sample);
     return true;
 }
 #endif
 
 bool jd_should_sample(uint32_t *sample, uint32_t period) {
-    if (in_future(*sample))
+    if (in_future(*sample)) {
+        sleep_until(*sample);
         return false;
+    }
 
     *sample += period;
 
@@ -162,18 +172,49 @@ bool jd_should_sample(uint32_t *sample, uint32_t period) {
         // we lost some samples
         *sample = now + period;
 
+    sleep_until(*sample);
     return true;
 }
 
 bool jd_should_sample_delay(uint32_t *sample, uint32_t period) {
-    if (in_future(*sample))
+    if (in_future(*sample)) {
+        sleep_until(*sample);
         return false;
+    }
 
     *sample = now + period;
 
+    sleep_until(*sample);
     return true;
 }
 
+void jd_index_sort(uint8_t *index, unsigned n, jd_index_key_t key, void *ctx) {
+    JD_ASSERT(n <= 0x100);
+    // insertion sort - n is small, and we want it stable
+    for (unsigned i = 0; i < n; ++i) {
+        uint32_t k = key(ctx, i);
+        unsigned j = i;
+        while (j > 0 && key(ctx, index[j - 1]) > k) {
+            index[j] = index[j - 1];
+            j--;
+        }
+        index[j] = i;
+    }
+}
+
+unsigned jd_index_lower_bound(const uint8_t *index, unsigned n, uint32_t k, jd_index_key_t key,
+                              void *ctx) {
+    unsigned l = 0, r = n;
+    while (l < r) {
+        unsigned m = (l + r) >> 1;
+        if (key(ctx, index[m]) < k)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return l;
+}
+
 void jd_to_hex(char *dst, const void *src, size_t len) {
     const char *hex = "0123456789abcdef";
     const uint8_t *p = src;